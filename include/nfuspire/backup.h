@@ -0,0 +1,21 @@
+// SPDX-License-Identifier: GPL-3.0-only
+/*
+ *  nfuspire/include/nfuspire/backup.h
+ *
+ *  Copyright (C) Emily <info@emy.sh>
+ */
+
+#ifndef NFUSPIRE_BACKUP_H_
+#define NFUSPIRE_BACKUP_H_
+
+#include <fuse.h>
+#include <nfuspire/nspire.h>
+
+#define BACKUP_PATH      "/.well-known/backup.tar"
+#define BACKUP_QUEUE_MAX (4 * 1024 * 1024)
+
+int backup_open(struct fuse_file_info *fi);
+int backup_read(char *buf, size_t size, off_t offset, struct fuse_file_info *fi);
+int backup_release(struct fuse_file_info *fi);
+
+#endif // NFUSPIRE_BACKUP_H_
@@ -0,0 +1,69 @@
+// SPDX-License-Identifier: GPL-3.0-only
+/*
+ *  nfuspire/include/nfuspire/cache.h
+ *
+ *  Copyright (C) Emily <info@emy.sh>
+ */
+
+#ifndef NFUSPIRE_CACHE_H_
+#define NFUSPIRE_CACHE_H_
+
+#include <nfuspire/nspire.h>
+#include <nspire.h>
+#include <stdint.h>
+
+#define CACHE_BUCKETS         1024
+#define CACHE_DEFAULT_TTL     5
+#define CACHE_DEFAULT_MAXSIZE (32 * 1024 * 1024)
+
+#define DIR_INFO_SIZE(num) (sizeof(struct nspire_dir_info) + (num) * sizeof(struct nspire_dir_item))
+
+typedef struct cache_entry {
+    struct cache_entry *next;
+    struct cache_entry *lru_prev;
+    struct cache_entry *lru_next;
+    char *path;
+
+    bool has_item;
+    uint64_t item_expires;
+    struct nspire_dir_item item;
+
+    uint64_t list_expires;
+    struct nspire_dir_info *list;
+
+    struct nspire_dir_item data_item;
+    unsigned char *data;
+    bool prefetched;
+} cache_entry_t;
+
+typedef struct nfuspire_cache {
+    pthread_mutex_t mutex;
+    cache_entry_t *buckets[CACHE_BUCKETS];
+    cache_entry_t *lru_head;
+    cache_entry_t *lru_tail;
+    size_t data_size;
+    uint64_t generation;
+} nfuspire_cache_t;
+
+int cache_init(nfuspire_ctx_t *ctx);
+void cache_free(nfuspire_ctx_t *ctx);
+
+bool cache_get_attr(nfuspire_ctx_t *ctx, const char *path, struct nspire_dir_item *item);
+void cache_put_attr(nfuspire_ctx_t *ctx, const char *path, const struct nspire_dir_item *item, uint64_t generation);
+bool cache_get_list(nfuspire_ctx_t *ctx, const char *path, struct nspire_dir_info **list);
+void cache_put_list(nfuspire_ctx_t *ctx, const char *path, const struct nspire_dir_info *list, uint64_t generation);
+bool cache_get_data(nfuspire_ctx_t *ctx, const char *path, const struct nspire_dir_item *item, unsigned char **data);
+bool cache_has_data(nfuspire_ctx_t *ctx, const char *path, const struct nspire_dir_item *item);
+void cache_put_data(
+    nfuspire_ctx_t *ctx, const char *path, const struct nspire_dir_item *item, const unsigned char *data,
+    bool prefetched
+);
+
+void cache_set_maxsize(nfuspire_ctx_t *ctx, unsigned long maxsize);
+void cache_set_ttl(nfuspire_ctx_t *ctx, unsigned int ttl);
+void cache_invalidate(nfuspire_ctx_t *ctx, const char *path);
+// Bumped by every invalidation, anything built from listings is stale once it changes
+uint64_t cache_generation(nfuspire_ctx_t *ctx);
+void cache_drop(nfuspire_ctx_t *ctx);
+
+#endif // NFUSPIRE_CACHE_H_
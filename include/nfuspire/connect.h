@@ -0,0 +1,32 @@
+// SPDX-License-Identifier: GPL-3.0-only
+/*
+ *  nfuspire/include/nfuspire/connect.h
+ *
+ *  Copyright (C) Emily <info@emy.sh>
+ */
+
+#ifndef NFUSPIRE_CONNECT_H_
+#define NFUSPIRE_CONNECT_H_
+
+#include <nfuspire/nspire.h>
+#include <stdint.h>
+
+#define CONNECT_DEFAULT_TIMEOUT 10
+#define DEVICE_LOCK_POLL_MS     10
+
+int connect_device(nfuspire_ctx_t *ctx);
+int connect_start(nfuspire_ctx_t *ctx);
+void connect_stop(nfuspire_ctx_t *ctx);
+int connect_wait(nfuspire_ctx_t *ctx);
+const char *connect_state_str(nfuspire_conn_state_t state);
+
+bool nfuspire_interrupted(nfuspire_ctx_t *ctx, uint64_t start);
+
+// Like pthread_mutex_lock, giving up with -EINTR once the request started at start is interrupted
+int nfuspire_lock(nfuspire_ctx_t *ctx, pthread_mutex_t *mutex, uint64_t start);
+// A single wait on cond, woken up now and then to give up with -EINTR once the request is interrupted
+int nfuspire_wait(nfuspire_ctx_t *ctx, pthread_cond_t *cond, pthread_mutex_t *mutex, uint64_t start);
+int nfuspire_device_lock(nfuspire_ctx_t *ctx);
+void nfuspire_device_unlock(nfuspire_ctx_t *ctx);
+
+#endif // NFUSPIRE_CONNECT_H_
@@ -0,0 +1,21 @@
+// SPDX-License-Identifier: GPL-3.0-only
+/*
+ *  nfuspire/include/nfuspire/control.h
+ *
+ *  Copyright (C) Emily <info@emy.sh>
+ */
+
+#ifndef NFUSPIRE_CONTROL_H_
+#define NFUSPIRE_CONTROL_H_
+
+#include <fuse.h>
+#include <nfuspire/nspire.h>
+
+#define CONTROL_PATH      "/.well-known/control"
+#define CONTROL_DATA_SIZE 1024
+
+int control_open(struct fuse_file_info *fi);
+int control_read(char *buf, size_t size, off_t offset);
+int control_write(const char *buf, size_t size);
+
+#endif // NFUSPIRE_CONTROL_H_
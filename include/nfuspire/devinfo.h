@@ -0,0 +1,25 @@
+// SPDX-License-Identifier: GPL-3.0-only
+/*
+ *  nfuspire/include/nfuspire/devinfo.h
+ *
+ *  Copyright (C) Emily <info@emy.sh>
+ */
+
+#ifndef NFUSPIRE_DEVINFO_H_
+#define NFUSPIRE_DEVINFO_H_
+
+#include <nfuspire/nspire.h>
+#include <nspire.h>
+#include <stdint.h>
+
+#define DEVINFO_DEFAULT_INTERVAL 30
+#define DEVINFO_RETRY_MS         250
+
+int devinfo_start(nfuspire_ctx_t *ctx);
+void devinfo_stop(nfuspire_ctx_t *ctx);
+int devinfo_set_interval(nfuspire_ctx_t *ctx, unsigned int interval);
+void devinfo_get(nfuspire_ctx_t *ctx, struct nspire_devinfo *devinfo);
+void devinfo_storage_used(nfuspire_ctx_t *ctx, int64_t delta);
+void devinfo_invalidate(nfuspire_ctx_t *ctx);
+
+#endif // NFUSPIRE_DEVINFO_H_
@@ -0,0 +1,48 @@
+// SPDX-License-Identifier: GPL-3.0-only
+/*
+ *  nfuspire/include/nfuspire/flight.h
+ *
+ *  Copyright (C) Emily <info@emy.sh>
+ */
+
+#ifndef NFUSPIRE_FLIGHT_H_
+#define NFUSPIRE_FLIGHT_H_
+
+#include <nfuspire/nspire.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum flight_op {
+    FLIGHT_ATTR,
+    FLIGHT_DIRLIST,
+    FLIGHT_READ,
+} flight_op_t;
+
+typedef struct flight {
+    struct flight *next;
+    flight_op_t op;
+    char *path;
+    uint64_t size;
+    uint64_t date;
+    uint64_t generation;
+    unsigned int refs;
+    bool prefetch;
+    bool done;
+    int rc;
+    void *data;
+    size_t data_size;
+    pthread_cond_t cond;
+} flight_t;
+
+int flight_join(
+    nfuspire_ctx_t *ctx, flight_op_t op, const char *path, uint64_t size, uint64_t date, uint64_t generation,
+    flight_t **flight, void **data, size_t *data_size
+);
+flight_t *flight_begin(
+    nfuspire_ctx_t *ctx, flight_op_t op, const char *path, uint64_t size, uint64_t date, uint64_t generation,
+    bool prefetch
+);
+void flight_land(nfuspire_ctx_t *ctx, flight_t *flight, int rc, const void *data, size_t data_size);
+
+#endif // NFUSPIRE_FLIGHT_H_
@@ -0,0 +1,27 @@
+// SPDX-License-Identifier: GPL-3.0-only
+/*
+ *  nfuspire/include/nfuspire/import.h
+ *
+ *  Copyright (C) Emily <info@emy.sh>
+ */
+
+#ifndef NFUSPIRE_IMPORT_H_
+#define NFUSPIRE_IMPORT_H_
+
+#include <fuse.h>
+#include <nfuspire/nspire.h>
+
+#define IMPORT_PATH        "/.well-known/import"
+#define IMPORT_STATUS_PATH "/.well-known/import_status"
+#define IMPORT_QUEUE_MAX   (4 * 1024 * 1024)
+#define IMPORT_STATUS_SIZE 16384
+// Long names and extended headers are kept in memory whole
+#define IMPORT_META_MAX 65536
+
+int import_open(struct fuse_file_info *fi);
+int import_write(const char *buf, size_t size, off_t offset, struct fuse_file_info *fi);
+int import_release(struct fuse_file_info *fi);
+int import_status_read(char *buf, size_t size, off_t offset);
+void import_stop(nfuspire_ctx_t *ctx);
+
+#endif // NFUSPIRE_IMPORT_H_
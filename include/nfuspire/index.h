@@ -0,0 +1,45 @@
+// SPDX-License-Identifier: GPL-3.0-only
+/*
+ *  nfuspire/include/nfuspire/index.h
+ *
+ *  Copyright (C) Emily <info@emy.sh>
+ */
+
+#ifndef NFUSPIRE_INDEX_H_
+#define NFUSPIRE_INDEX_H_
+
+#include <fuse.h>
+#include <nfuspire/nspire.h>
+#include <stdint.h>
+
+#define INDEX_PATH        "/.well-known/index"
+#define INDEX_BIN_PATH    "/.well-known/index.bin"
+#define INDEX_DEFAULT_TTL 60
+
+/*
+ * The binary index starts with INDEX_BIN_MAGIC and a little endian
+ * 32 bit entry count. Every entry is a type byte (INDEX_BIN_FILE or
+ * INDEX_BIN_DIR), little endian 64 bit size and date, a little endian
+ * 16 bit path length and the path itself, without a terminator.
+ */
+#define INDEX_BIN_MAGIC     "NSPINDX1"
+#define INDEX_BIN_MAGIC_LEN 8
+#define INDEX_BIN_FILE      0
+#define INDEX_BIN_DIR       1
+
+typedef struct index_data {
+    unsigned int refs;
+    uint64_t generation;
+    uint64_t built;
+    char *text;
+    size_t text_size;
+    unsigned char *bin;
+    size_t bin_size;
+} index_data_t;
+
+int index_open(struct fuse_file_info *fi);
+int index_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi);
+int index_release(struct fuse_file_info *fi);
+void index_free(nfuspire_ctx_t *ctx);
+
+#endif // NFUSPIRE_INDEX_H_
@@ -8,8 +8,20 @@
 #ifndef NFUSPIRE_INFO_H_
 #define NFUSPIRE_INFO_H_
 
+#include <fuse.h>
+#include <nfuspire/nspire.h>
+
+#define INFO_PATH_PREFIX "/.well-known/info/"
+#define INFO_DATA_SIZE   1024
+
 int info_readdir(void *buf, fuse_fill_dir_t filler);
 int info_getattr(const char *path, struct stat *stbuf);
-int info_read(const char *path, char *buf, size_t size, off_t offset);
+int info_open(const char *path, struct fuse_file_info *fi);
+int info_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi);
+int info_poll(struct fuse_file_info *fi, struct fuse_pollhandle *ph, unsigned *reventsp);
+int info_release(struct fuse_file_info *fi);
+
+// Wakes up pollers of every open info file, ctx->devinfo_mutex must be held
+void info_notify(nfuspire_ctx_t *ctx);
 
 #endif // NFUSPIRE_INFO_H_
@@ -0,0 +1,50 @@
+// SPDX-License-Identifier: GPL-3.0-only
+/*
+ *  nfuspire/include/nfuspire/journal.h
+ *
+ *  Copyright (C) Emily <info@emy.sh>
+ */
+
+#ifndef NFUSPIRE_JOURNAL_H_
+#define NFUSPIRE_JOURNAL_H_
+
+#include <nfuspire/nspire.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define JOURNAL_MAGIC  0x4a46464e // "NFFJ"
+#define JOURNAL_SUFFIX ".jrn"
+
+typedef enum journal_type {
+    JOURNAL_HEADER,
+    JOURNAL_WRITE,
+    JOURNAL_TRUNCATE,
+    JOURNAL_RENAME,
+    JOURNAL_BASE,
+} journal_type_t;
+
+// Followed by len bytes of payload, the checksum covers both
+typedef struct journal_record {
+    uint32_t magic;
+    uint32_t type;
+    uint64_t offset;
+    uint32_t len;
+    uint32_t crc;
+} journal_record_t;
+
+typedef struct journal {
+    int fd;
+    char *path;
+} journal_t;
+
+int journal_resolve(nfuspire_ctx_t *ctx);
+int journal_start(nfuspire_ctx_t *ctx);
+void journal_stop(nfuspire_ctx_t *ctx);
+int journal_ready(nfuspire_ctx_t *ctx);
+int journal_write(nfuspire_ctx_t *ctx, nfuspire_file_cache_t *cache, const void *buf, size_t size, off_t offset);
+int journal_truncate(nfuspire_ctx_t *ctx, nfuspire_file_cache_t *cache, off_t size);
+void journal_rename(nfuspire_file_cache_t *cache);
+void journal_discard(nfuspire_file_cache_t *cache);
+void journal_close(nfuspire_file_cache_t *cache);
+
+#endif // NFUSPIRE_JOURNAL_H_
@@ -9,25 +9,124 @@
 #define NFUSPIRE_NSPIRE_H_
 
 #include <fuse.h>
+#include <nfuspire/stats.h>
 #include <nspire.h>
 #include <pthread.h>
+#include <stdint.h>
+
+typedef enum nfuspire_conn_state {
+    NFUSPIRE_CONNECTING,
+    NFUSPIRE_CONNECTED,
+    NFUSPIRE_FAILED,
+} nfuspire_conn_state_t;
+
+struct flight;
+struct import_stream;
+struct index_data;
+struct info_handle;
+struct journal;
+struct nfuspire_file_cache;
+struct nfuspire_cache;
+struct prefetch_item;
 
 typedef struct nfuspire_ctx {
     nspire_handle_t *handle;
-    struct nspire_devinfo devinfo;
     pthread_mutex_t mutex;
+    nfuspire_stats_t stats;
+    int io_uring;
+
+    nfuspire_conn_state_t conn_state;
+    int conn_error;
+    pthread_cond_t conn_cond;
+    pthread_t conn_thread;
+    unsigned int conn_timeout;
+    int async_connect;
+
+    pthread_mutex_t files_mutex;
+    struct nfuspire_file_cache *files;
+
+    char *journal_dir;
+    pthread_t journal_thread;
+    bool journal_running;
+
+    pthread_mutex_t flights_mutex;
+    struct flight *flights;
+
+    struct nfuspire_cache *cache;
+    unsigned int cache_ttl;
+    unsigned long cache_maxsize;
+
+    pthread_mutex_t index_build_mutex;
+    pthread_mutex_t index_mutex;
+    struct index_data *index;
+    unsigned int index_ttl;
+
+    pthread_mutex_t prefetch_mutex;
+    pthread_cond_t prefetch_cond;
+    pthread_t prefetch_thread;
+    unsigned long prefetch_size;
+    bool prefetch_running;
+    bool prefetch_waiting;
+    struct prefetch_item *prefetch_queue;
+    uint64_t device_requests;
+
+    pthread_cond_t writeback_cond;
+    pthread_t writeback_thread;
+    unsigned int upload_delay;
+    bool writeback_running;
+
+    struct nspire_devinfo devinfo;
+    pthread_mutex_t devinfo_mutex;
+    pthread_cond_t devinfo_cond;
+    pthread_t devinfo_thread;
+    unsigned int devinfo_interval;
+    bool devinfo_running;
+    bool devinfo_stale;
+    struct info_handle *info_handles;
+
+    pthread_mutex_t import_mutex;
+    struct import_stream *import;
 } nfuspire_ctx_t;
 
 typedef struct nfuspire_file_cache {
+    struct nfuspire_file_cache *next;
     pthread_mutex_t mutex;
+    char *path;
+    unsigned int refs;
     bool need_sync;
+    bool on_device;
+    bool unlinked;
+    bool uploading;
+    bool pending;
+    uint64_t pending_until;
+    int upload_error;
+    time_t mtime;
     size_t size;
+    size_t device_size;
+    // Bumped by every change to data, an upload only cleans the version it copied
+    uint64_t version;
     unsigned char *data;
+    struct journal *journal;
 } nfuspire_file_cache_t;
 
 #define current_nfuspire_ctx ((nfuspire_ctx_t *)(fuse_get_context()->private_data))
 
+// Called for every entry of a walk, a non-zero return stops it and is returned by nfuspire_walk
+typedef int (*nfuspire_walk_fn)(nfuspire_ctx_t *ctx, const char *path, const struct nspire_dir_item *item, void *arg);
+
 int nfuspire_error(int error);
+int nfuspire_attr(nfuspire_ctx_t *ctx, const char *path, struct nspire_dir_item *item);
+int nfuspire_dirlist(nfuspire_ctx_t *ctx, const char *path, struct nspire_dir_info **list);
+int nfuspire_file_download(
+    nfuspire_ctx_t *ctx, const char *path, const struct nspire_dir_item *item, unsigned char **data, size_t *size
+);
+int nfuspire_file_fetch(
+    nfuspire_ctx_t *ctx, const char *path, const struct nspire_dir_item *item, unsigned char **data, size_t *size
+);
+int nfuspire_walk(nfuspire_ctx_t *ctx, const char *path, nfuspire_walk_fn fn, void *arg);
+void nfuspire_path_join(char *buf, size_t size, const char *dir, const char *name);
+int nfuspire_file_sync(nfuspire_ctx_t *ctx, nfuspire_file_cache_t *cache);
+void nfuspire_file_put(nfuspire_ctx_t *ctx, nfuspire_file_cache_t *cache);
 int nfuspire_readdir(const char *path, void *buf, fuse_fill_dir_t filler);
 int nfuspire_getattr(const char *path, struct stat *stbuf);
 int nfuspire_mkdir(const char *path);
@@ -38,8 +137,11 @@ int nfuspire_create(const char *path, struct fuse_file_info *fi);
 int nfuspire_open(const char *path, struct fuse_file_info *fi);
 int nfuspire_read(char *buf, size_t size, off_t offset, struct fuse_file_info *fi);
 int nfuspire_write(const char *buf, size_t size, off_t offset, struct fuse_file_info *fi);
-int nfuspire_fsync(const char *path, struct fuse_file_info *fi);
-int nfuspire_release(const char *path, struct fuse_file_info *fi);
+ssize_t nfuspire_copy_file_range(
+    struct fuse_file_info *fi_in, off_t offset_in, struct fuse_file_info *fi_out, off_t offset_out, size_t size
+);
+int nfuspire_fsync(struct fuse_file_info *fi);
+int nfuspire_release(struct fuse_file_info *fi);
 int nfuspire_truncate(const char *path, off_t size);
 
 #endif // NFUSPIRE_NSPIRE_H_
@@ -0,0 +1,29 @@
+// SPDX-License-Identifier: GPL-3.0-only
+/*
+ *  nfuspire/include/nfuspire/prefetch.h
+ *
+ *  Copyright (C) Emily <info@emy.sh>
+ */
+
+#ifndef NFUSPIRE_PREFETCH_H_
+#define NFUSPIRE_PREFETCH_H_
+
+#include <nfuspire/nspire.h>
+#include <nspire.h>
+
+#define PREFETCH_IDLE_MS   100
+#define PREFETCH_MAX_FILES 32
+
+typedef struct prefetch_item {
+    struct prefetch_item *next;
+    char *path;
+    struct nspire_dir_item item;
+} prefetch_item_t;
+
+int prefetch_start(nfuspire_ctx_t *ctx);
+void prefetch_stop(nfuspire_ctx_t *ctx);
+int prefetch_set_size(nfuspire_ctx_t *ctx, unsigned long size);
+void prefetch_dir(nfuspire_ctx_t *ctx, const char *path, const struct nspire_dir_info *list);
+void prefetch_note_request(nfuspire_ctx_t *ctx);
+
+#endif // NFUSPIRE_PREFETCH_H_
@@ -0,0 +1,40 @@
+// SPDX-License-Identifier: GPL-3.0-only
+/*
+ *  nfuspire/include/nfuspire/stats.h
+ *
+ *  Copyright (C) Emily <info@emy.sh>
+ */
+
+#ifndef NFUSPIRE_STATS_H_
+#define NFUSPIRE_STATS_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define STATS_PATH      "/.well-known/stats"
+#define STATS_DATA_SIZE 4096
+
+typedef struct nfuspire_stats {
+    pthread_mutex_t mutex;
+    uint64_t cancelled;
+    uint64_t cancelled_wait_total;
+    uint64_t cancelled_wait_max;
+    uint64_t shared;
+    uint64_t prefetched;
+    uint64_t prefetched_bytes;
+    uint64_t prefetch_hits;
+    uint64_t prefetch_cancelled;
+} nfuspire_stats_t;
+
+// Milliseconds on CLOCK_MONOTONIC, the clock behind every timeout and expiry
+uint64_t stats_now(void);
+void stats_init(nfuspire_stats_t *stats);
+void stats_cancelled(nfuspire_stats_t *stats, uint64_t waited);
+void stats_shared(nfuspire_stats_t *stats);
+void stats_prefetched(nfuspire_stats_t *stats, uint64_t bytes);
+void stats_prefetch_hit(nfuspire_stats_t *stats);
+void stats_prefetch_cancelled(nfuspire_stats_t *stats, uint64_t count);
+int stats_read(nfuspire_stats_t *stats, char *buf, size_t size, off_t offset);
+
+#endif // NFUSPIRE_STATS_H_
@@ -0,0 +1,56 @@
+// SPDX-License-Identifier: GPL-3.0-only
+/*
+ *  nfuspire/include/nfuspire/tar.h
+ *
+ *  Copyright (C) Emily <info@emy.sh>
+ */
+
+#ifndef NFUSPIRE_TAR_H_
+#define NFUSPIRE_TAR_H_
+
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#define TAR_BLOCK_SIZE 512
+#define TAR_PADDING(size) ((TAR_BLOCK_SIZE - ((size) % TAR_BLOCK_SIZE)) % TAR_BLOCK_SIZE)
+// A GNU long name header, the name itself and the real header
+#define TAR_HEADER_MAX (2 * TAR_BLOCK_SIZE + PATH_MAX + TAR_BLOCK_SIZE)
+
+#define TAR_TYPE_FILE      '0'
+#define TAR_TYPE_OLDFILE   '\0'
+#define TAR_TYPE_CONTIG    '7'
+#define TAR_TYPE_DIR       '5'
+#define TAR_TYPE_LONGNAME  'L'
+#define TAR_TYPE_PAX       'x'
+#define TAR_TYPE_PAXGLOBAL 'g'
+
+typedef struct tar_header {
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char chksum[8];
+    char typeflag;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char pad[12];
+} tar_header_t;
+
+size_t tar_header(unsigned char *buf, const char *name, char type, uint64_t size, time_t mtime);
+bool tar_header_zero(const tar_header_t *header);
+bool tar_header_valid(const tar_header_t *header);
+uint64_t tar_number(const char *field, size_t len);
+void tar_name(const tar_header_t *header, char *name, size_t size);
+bool tar_pax_path(const char *data, size_t len, char *name, size_t size);
+
+#endif // NFUSPIRE_TAR_H_
@@ -0,0 +1,24 @@
+// SPDX-License-Identifier: GPL-3.0-only
+/*
+ *  nfuspire/include/nfuspire/writeback.h
+ *
+ *  Copyright (C) Emily <info@emy.sh>
+ */
+
+#ifndef NFUSPIRE_WRITEBACK_H_
+#define NFUSPIRE_WRITEBACK_H_
+
+#include <nfuspire/nspire.h>
+
+#define WRITEBACK_DEFAULT_DELAY 0
+#define WRITEBACK_RETRY_DELAY   5000
+
+int writeback_start(nfuspire_ctx_t *ctx);
+void writeback_stop(nfuspire_ctx_t *ctx);
+bool writeback_defer(nfuspire_ctx_t *ctx, nfuspire_file_cache_t *cache);
+int writeback_set_delay(nfuspire_ctx_t *ctx, unsigned int delay);
+// Files waiting to retry a failed upload, error is the last failure of one of them
+unsigned int writeback_failed(nfuspire_ctx_t *ctx, int *error);
+int writeback_flush(nfuspire_ctx_t *ctx);
+
+#endif // NFUSPIRE_WRITEBACK_H_
@@ -0,0 +1,277 @@
+// SPDX-License-Identifier: GPL-3.0-only
+/*
+ *  nfuspire/src/backup.c
+ *
+ *  Copyright (C) Emily <info@emy.sh>
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <nfuspire/backup.h>
+#include <nfuspire/cache.h>
+#include <nfuspire/connect.h>
+#include <nfuspire/nspire.h>
+#include <nfuspire/tar.h>
+#include <nspire.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct backup_chunk {
+    struct backup_chunk *next;
+    size_t len;
+    size_t pos;
+    unsigned char data[];
+} backup_chunk_t;
+
+/*
+ * The archive is produced by a thread walking the device, which
+ * downloads the next file while the reader drains the queue. The queue
+ * is bounded, but always accepts one chunk so large files still fit.
+ */
+typedef struct backup_stream {
+    nfuspire_ctx_t *ctx;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t data_cond;
+    pthread_cond_t space_cond;
+    backup_chunk_t *head;
+    backup_chunk_t *tail;
+    size_t queued;
+    off_t offset;
+    bool stopping;
+    bool finished;
+    int error;
+} backup_stream_t;
+
+static bool backup_push(backup_stream_t *backup, backup_chunk_t *chunk) {
+    pthread_mutex_lock(&backup->mutex);
+
+    while (!backup->stopping && backup->head && backup->queued + chunk->len > BACKUP_QUEUE_MAX) {
+        pthread_cond_wait(&backup->space_cond, &backup->mutex);
+    }
+
+    if (backup->stopping) {
+        pthread_mutex_unlock(&backup->mutex);
+        free(chunk);
+        return false;
+    }
+
+    if (backup->tail) {
+        backup->tail->next = chunk;
+    } else {
+        backup->head = chunk;
+    }
+
+    backup->tail = chunk;
+    backup->queued += chunk->len;
+
+    pthread_cond_signal(&backup->data_cond);
+    pthread_mutex_unlock(&backup->mutex);
+    return true;
+}
+
+static bool backup_entry(
+    backup_stream_t *backup, const char *path, char type, const struct nspire_dir_item *item,
+    const unsigned char *data, size_t size
+) {
+    unsigned char header[TAR_HEADER_MAX];
+    backup_chunk_t *chunk;
+    size_t header_len;
+
+    // Archive members are relative to the device root
+    header_len = tar_header(header, path + 1, type, size, item->date);
+
+    chunk = calloc(1, sizeof(backup_chunk_t) + header_len + size + TAR_PADDING(size));
+    if (!chunk) {
+        backup->error = -ENOMEM;
+        return false;
+    }
+
+    memcpy(chunk->data, header, header_len);
+    if (size) {
+        memcpy(chunk->data + header_len, data, size);
+    }
+
+    chunk->len = header_len + size + TAR_PADDING(size);
+    return backup_push(backup, chunk);
+}
+
+// -ECANCELED stops the walk once the reader is gone or memory ran out, backup->error already tells which
+static int backup_visit(nfuspire_ctx_t *ctx, const char *path, const struct nspire_dir_item *item, void *arg) {
+    backup_stream_t *backup = arg;
+    unsigned char *data;
+    size_t size;
+    char dir[PATH_MAX];
+    bool running;
+    int rc;
+
+    if (item->type == NSPIRE_DIR) {
+        snprintf(dir, sizeof(dir), "%s/", path);
+        return backup_entry(backup, dir, TAR_TYPE_DIR, item, nullptr, 0) ? 0 : -ECANCELED;
+    }
+
+    // Backups go around the content cache so they don't evict the working set
+    if (!cache_get_data(ctx, path, item, &data)) {
+        rc = nfuspire_file_download(ctx, path, item, &data, &size);
+        if (rc) {
+            // Gone since it was listed, like a directory that vanished
+            return rc == -ENOENT ? 0 : rc;
+        }
+    } else {
+        size = item->size;
+    }
+
+    running = backup_entry(backup, path, TAR_TYPE_FILE, item, data, size);
+    free(data);
+    return running ? 0 : -ECANCELED;
+}
+
+static void *backup_worker(void *arg) {
+    backup_stream_t *backup = arg;
+    backup_chunk_t *chunk;
+    int rc;
+
+    rc = nfuspire_walk(backup->ctx, "/", backup_visit, backup);
+    if (rc && rc != -ECANCELED) {
+        backup->error = rc;
+    }
+
+    if (!rc) {
+        // End of archive marker
+        chunk = calloc(1, sizeof(backup_chunk_t) + 2 * TAR_BLOCK_SIZE);
+        if (chunk) {
+            chunk->len = 2 * TAR_BLOCK_SIZE;
+            backup_push(backup, chunk);
+        } else {
+            backup->error = -ENOMEM;
+        }
+    }
+
+    pthread_mutex_lock(&backup->mutex);
+    backup->finished = true;
+    pthread_cond_broadcast(&backup->data_cond);
+    pthread_mutex_unlock(&backup->mutex);
+
+    return nullptr;
+}
+
+int backup_open(struct fuse_file_info *fi) {
+    backup_stream_t *backup;
+    int rc;
+
+    if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+        return -EACCES;
+    }
+
+    backup = calloc(1, sizeof(backup_stream_t));
+    if (!backup) {
+        return -ENOMEM;
+    }
+
+    backup->ctx = current_nfuspire_ctx;
+    pthread_mutex_init(&backup->mutex, NULL);
+    pthread_cond_init(&backup->data_cond, NULL);
+    pthread_cond_init(&backup->space_cond, NULL);
+
+    rc = pthread_create(&backup->thread, NULL, backup_worker, backup);
+    if (rc) {
+        free(backup);
+        return -rc;
+    }
+
+    // Generated on the fly, the size isn't known up front and reads must be sequential
+    fi->direct_io = 1;
+    fi->nonseekable = 1;
+    fi->fh = (typeof(fi->fh))backup;
+    return 0;
+}
+
+int backup_read(char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+    backup_stream_t *backup = (backup_stream_t *)(fi->fh);
+    backup_chunk_t *chunk;
+    size_t done = 0, len;
+    uint64_t start = stats_now();
+    int rc = 0;
+
+    if (!backup) {
+        return -EINVAL;
+    }
+
+    pthread_mutex_lock(&backup->mutex);
+
+    if (offset != backup->offset) {
+        pthread_mutex_unlock(&backup->mutex);
+        return -ESPIPE;
+    }
+
+    while (done < size && rc != -EINTR) {
+        // Waiting on a slow file download, which the reader may give up on
+        while (!backup->head && !backup->finished && !rc) {
+            rc = nfuspire_wait(backup->ctx, &backup->data_cond, &backup->mutex, start);
+        }
+
+        chunk = backup->head;
+        if (!chunk || rc) {
+            break;
+        }
+
+        len = chunk->len - chunk->pos;
+        if (len > size - done) {
+            len = size - done;
+        }
+
+        memcpy(buf + done, chunk->data + chunk->pos, len);
+        chunk->pos += len;
+        done += len;
+
+        if (chunk->pos == chunk->len) {
+            backup->head = chunk->next;
+            if (!backup->head) {
+                backup->tail = nullptr;
+            }
+
+            backup->queued -= chunk->len;
+            free(chunk);
+            pthread_cond_signal(&backup->space_cond);
+        }
+    }
+
+    backup->offset += done;
+    if (done) {
+        rc = (int)done;
+    } else if (!rc && backup->error) {
+        rc = backup->error;
+    }
+
+    pthread_mutex_unlock(&backup->mutex);
+    return rc;
+}
+
+int backup_release(struct fuse_file_info *fi) {
+    backup_stream_t *backup = (backup_stream_t *)(fi->fh);
+    backup_chunk_t *chunk;
+
+    if (!backup) {
+        return -EINVAL;
+    }
+
+    pthread_mutex_lock(&backup->mutex);
+    backup->stopping = true;
+    pthread_cond_broadcast(&backup->space_cond);
+    pthread_mutex_unlock(&backup->mutex);
+
+    pthread_join(backup->thread, NULL);
+
+    while ((chunk = backup->head)) {
+        backup->head = chunk->next;
+        free(chunk);
+    }
+
+    free(backup);
+    fi->fh = 0;
+
+    return 0;
+}
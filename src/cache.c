@@ -0,0 +1,447 @@
+// SPDX-License-Identifier: GPL-3.0-only
+/*
+ *  nfuspire/src/cache.c
+ *
+ *  Copyright (C) Emily <info@emy.sh>
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <nfuspire/cache.h>
+#include <nfuspire/nspire.h>
+#include <nspire.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static unsigned int cache_hash(const char *path) {
+    unsigned int hash = 5381;
+
+    while (*path) {
+        hash = hash * 33 + (unsigned char)*path++;
+    }
+
+    return hash % CACHE_BUCKETS;
+}
+
+static cache_entry_t *cache_lookup(nfuspire_cache_t *cache, const char *path, bool create) {
+    unsigned int bucket = cache_hash(path);
+    cache_entry_t *entry;
+
+    for (entry = cache->buckets[bucket]; entry; entry = entry->next) {
+        if (strcmp(entry->path, path) == 0) {
+            return entry;
+        }
+    }
+
+    if (!create) {
+        return nullptr;
+    }
+
+    entry = calloc(1, sizeof(cache_entry_t));
+    if (!entry) {
+        return nullptr;
+    }
+
+    entry->path = strdup(path);
+    if (!entry->path) {
+        free(entry);
+        return nullptr;
+    }
+
+    entry->next = cache->buckets[bucket];
+    cache->buckets[bucket] = entry;
+    return entry;
+}
+
+static void cache_lru_unlink(nfuspire_cache_t *cache, cache_entry_t *entry) {
+    if (entry->lru_prev) {
+        entry->lru_prev->lru_next = entry->lru_next;
+    } else {
+        cache->lru_head = entry->lru_next;
+    }
+
+    if (entry->lru_next) {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    } else {
+        cache->lru_tail = entry->lru_prev;
+    }
+
+    entry->lru_prev = entry->lru_next = nullptr;
+}
+
+static void cache_lru_push(nfuspire_cache_t *cache, cache_entry_t *entry) {
+    entry->lru_prev = nullptr;
+    entry->lru_next = cache->lru_head;
+
+    if (cache->lru_head) {
+        cache->lru_head->lru_prev = entry;
+    } else {
+        cache->lru_tail = entry;
+    }
+
+    cache->lru_head = entry;
+}
+
+static void cache_data_release(nfuspire_cache_t *cache, cache_entry_t *entry) {
+    if (!entry->data) {
+        return;
+    }
+
+    cache_lru_unlink(cache, entry);
+    cache->data_size -= entry->data_item.size;
+
+    free(entry->data);
+    entry->data = nullptr;
+}
+
+static void cache_remove(nfuspire_cache_t *cache, cache_entry_t *entry) {
+    cache_entry_t **it;
+
+    for (it = &cache->buckets[cache_hash(entry->path)]; *it; it = &(*it)->next) {
+        if (*it == entry) {
+            *it = entry->next;
+            break;
+        }
+    }
+
+    cache_data_release(cache, entry);
+
+    if (entry->list) {
+        free(entry->list);
+    }
+
+    free(entry->path);
+    free(entry);
+}
+
+// Drops entries that don't hold anything anymore
+static void cache_trim(nfuspire_cache_t *cache, cache_entry_t *entry) {
+    if (!entry->has_item && !entry->list && !entry->data) {
+        cache_remove(cache, entry);
+    }
+}
+
+int cache_init(nfuspire_ctx_t *ctx) {
+    ctx->cache = calloc(1, sizeof(nfuspire_cache_t));
+    if (!ctx->cache) {
+        return -ENOMEM;
+    }
+
+    pthread_mutex_init(&ctx->cache->mutex, NULL);
+    return 0;
+}
+
+void cache_free(nfuspire_ctx_t *ctx) {
+    if (!ctx->cache) {
+        return;
+    }
+
+    cache_drop(ctx);
+    free(ctx->cache);
+    ctx->cache = nullptr;
+}
+
+bool cache_get_attr(nfuspire_ctx_t *ctx, const char *path, struct nspire_dir_item *item) {
+    nfuspire_cache_t *cache = ctx->cache;
+    cache_entry_t *entry;
+    bool found = false;
+
+    pthread_mutex_lock(&cache->mutex);
+
+    entry = cache_lookup(cache, path, false);
+    if (entry && entry->has_item) {
+        if (entry->item_expires > stats_now()) {
+            *item = entry->item;
+            found = true;
+        } else {
+            entry->has_item = false;
+            cache_trim(cache, entry);
+        }
+    }
+
+    pthread_mutex_unlock(&cache->mutex);
+    return found;
+}
+
+static void cache_put_attr_locked(nfuspire_ctx_t *ctx, const char *path, const struct nspire_dir_item *item) {
+    cache_entry_t *entry;
+
+    entry = cache_lookup(ctx->cache, path, true);
+    if (!entry) {
+        return;
+    }
+
+    entry->item = *item;
+    entry->has_item = true;
+    entry->item_expires = stats_now() + ctx->cache_ttl * 1000UL;
+}
+
+// Results asked for before the last invalidation may predate it and are dropped
+void cache_put_attr(nfuspire_ctx_t *ctx, const char *path, const struct nspire_dir_item *item, uint64_t generation) {
+    if (!ctx->cache_ttl) {
+        return;
+    }
+
+    pthread_mutex_lock(&ctx->cache->mutex);
+
+    if (ctx->cache->generation == generation) {
+        cache_put_attr_locked(ctx, path, item);
+    }
+
+    pthread_mutex_unlock(&ctx->cache->mutex);
+}
+
+bool cache_get_list(nfuspire_ctx_t *ctx, const char *path, struct nspire_dir_info **list) {
+    nfuspire_cache_t *cache = ctx->cache;
+    cache_entry_t *entry;
+    bool found = false;
+
+    pthread_mutex_lock(&cache->mutex);
+
+    entry = cache_lookup(cache, path, false);
+    if (entry && entry->list) {
+        if (entry->list_expires > stats_now()) {
+            *list = malloc(DIR_INFO_SIZE(entry->list->num));
+            if (*list) {
+                memcpy(*list, entry->list, DIR_INFO_SIZE(entry->list->num));
+                found = true;
+            }
+        } else {
+            free(entry->list);
+            entry->list = nullptr;
+            cache_trim(cache, entry);
+        }
+    }
+
+    pthread_mutex_unlock(&cache->mutex);
+    return found;
+}
+
+void cache_put_list(nfuspire_ctx_t *ctx, const char *path, const struct nspire_dir_info *list, uint64_t generation) {
+    cache_entry_t *entry;
+    char child[PATH_MAX];
+
+    if (!ctx->cache_ttl) {
+        return;
+    }
+
+    pthread_mutex_lock(&ctx->cache->mutex);
+
+    if (ctx->cache->generation != generation) {
+        goto exit;
+    }
+
+    entry = cache_lookup(ctx->cache, path, true);
+    if (!entry) {
+        goto exit;
+    }
+
+    if (entry->list) {
+        free(entry->list);
+    }
+
+    entry->list = malloc(DIR_INFO_SIZE(list->num));
+    if (!entry->list) {
+        cache_trim(ctx->cache, entry);
+        goto exit;
+    }
+
+    memcpy(entry->list, list, DIR_INFO_SIZE(list->num));
+    entry->list_expires = stats_now() + ctx->cache_ttl * 1000UL;
+
+    // A listing already carries the attributes of every child
+    for (uint64_t i = 0; i < list->num; i++) {
+        nfuspire_path_join(child, sizeof(child), path, list->items[i].name);
+        cache_put_attr_locked(ctx, child, &list->items[i]);
+    }
+
+exit:
+    pthread_mutex_unlock(&ctx->cache->mutex);
+}
+
+bool cache_get_data(nfuspire_ctx_t *ctx, const char *path, const struct nspire_dir_item *item, unsigned char **data) {
+    nfuspire_cache_t *cache = ctx->cache;
+    cache_entry_t *entry;
+    bool found = false;
+
+    pthread_mutex_lock(&cache->mutex);
+
+    entry = cache_lookup(cache, path, false);
+    if (!entry || !entry->data) {
+        goto exit;
+    }
+
+    // Content is only valid for the exact version of the file it was read from
+    if (entry->data_item.size != item->size || entry->data_item.date != item->date) {
+        cache_data_release(cache, entry);
+        cache_trim(cache, entry);
+        goto exit;
+    }
+
+    *data = malloc(item->size);
+    if (!*data) {
+        goto exit;
+    }
+
+    memcpy(*data, entry->data, item->size);
+    found = true;
+
+    // Only the first use of a prefetched file counts as a hit
+    if (entry->prefetched) {
+        entry->prefetched = false;
+        stats_prefetch_hit(&ctx->stats);
+    }
+
+    cache_lru_unlink(cache, entry);
+    cache_lru_push(cache, entry);
+
+exit:
+    pthread_mutex_unlock(&cache->mutex);
+    return found;
+}
+
+bool cache_has_data(nfuspire_ctx_t *ctx, const char *path, const struct nspire_dir_item *item) {
+    nfuspire_cache_t *cache = ctx->cache;
+    cache_entry_t *entry;
+    bool found;
+
+    pthread_mutex_lock(&cache->mutex);
+
+    entry = cache_lookup(cache, path, false);
+    found = entry && entry->data && entry->data_item.size == item->size && entry->data_item.date == item->date;
+
+    pthread_mutex_unlock(&cache->mutex);
+    return found;
+}
+
+void cache_put_data(
+    nfuspire_ctx_t *ctx, const char *path, const struct nspire_dir_item *item, const unsigned char *data,
+    bool prefetched
+) {
+    nfuspire_cache_t *cache = ctx->cache;
+    cache_entry_t *entry;
+
+    if (!item->size || item->size > ctx->cache_maxsize) {
+        return;
+    }
+
+    pthread_mutex_lock(&cache->mutex);
+
+    entry = cache_lookup(cache, path, true);
+    if (!entry) {
+        goto exit;
+    }
+
+    cache_data_release(cache, entry);
+
+    while (cache->lru_tail && cache->data_size + item->size > ctx->cache_maxsize) {
+        cache_entry_t *victim = cache->lru_tail;
+
+        cache_data_release(cache, victim);
+        if (victim != entry) {
+            cache_trim(cache, victim);
+        }
+    }
+
+    entry->data = malloc(item->size);
+    if (!entry->data) {
+        cache_trim(cache, entry);
+        goto exit;
+    }
+
+    memcpy(entry->data, data, item->size);
+    entry->data_item = *item;
+    entry->prefetched = prefetched;
+    cache->data_size += item->size;
+    cache_lru_push(cache, entry);
+
+exit:
+    pthread_mutex_unlock(&cache->mutex);
+}
+
+void cache_set_maxsize(nfuspire_ctx_t *ctx, unsigned long maxsize) {
+    nfuspire_cache_t *cache = ctx->cache;
+
+    pthread_mutex_lock(&cache->mutex);
+
+    ctx->cache_maxsize = maxsize;
+
+    while (cache->lru_tail && cache->data_size > maxsize) {
+        cache_entry_t *victim = cache->lru_tail;
+
+        cache_data_release(cache, victim);
+        cache_trim(cache, victim);
+    }
+
+    pthread_mutex_unlock(&cache->mutex);
+}
+
+void cache_set_ttl(nfuspire_ctx_t *ctx, unsigned int ttl) {
+    pthread_mutex_lock(&ctx->cache->mutex);
+    ctx->cache_ttl = ttl;
+    pthread_mutex_unlock(&ctx->cache->mutex);
+}
+
+void cache_invalidate(nfuspire_ctx_t *ctx, const char *path) {
+    nfuspire_cache_t *cache = ctx->cache;
+    size_t len = strlen(path);
+    char parent[PATH_MAX];
+    char *slash;
+    cache_entry_t *entry, *next;
+
+    snprintf(parent, sizeof(parent), "%s", path);
+    slash = strrchr(parent, '/');
+    if (slash) {
+        slash[slash == parent ? 1 : 0] = '\0';
+    }
+
+    pthread_mutex_lock(&cache->mutex);
+
+    cache->generation++;
+
+    for (unsigned int i = 0; i < CACHE_BUCKETS; i++) {
+        for (entry = cache->buckets[i]; entry; entry = next) {
+            next = entry->next;
+
+            if (strcmp(entry->path, parent) == 0 && entry->list) {
+                free(entry->list);
+                entry->list = nullptr;
+                cache_trim(cache, entry);
+            } else if (strncmp(entry->path, path, len) == 0 && (!entry->path[len] || entry->path[len] == '/')) {
+                cache_remove(cache, entry);
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&cache->mutex);
+}
+
+void cache_drop(nfuspire_ctx_t *ctx) {
+    nfuspire_cache_t *cache = ctx->cache;
+    cache_entry_t *entry, *next;
+
+    pthread_mutex_lock(&cache->mutex);
+
+    cache->generation++;
+
+    for (unsigned int i = 0; i < CACHE_BUCKETS; i++) {
+        for (entry = cache->buckets[i]; entry; entry = next) {
+            next = entry->next;
+            cache_remove(cache, entry);
+        }
+    }
+
+    pthread_mutex_unlock(&cache->mutex);
+}
+
+uint64_t cache_generation(nfuspire_ctx_t *ctx) {
+    uint64_t generation;
+
+    pthread_mutex_lock(&ctx->cache->mutex);
+    generation = ctx->cache->generation;
+    pthread_mutex_unlock(&ctx->cache->mutex);
+
+    return generation;
+}
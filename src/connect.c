@@ -0,0 +1,215 @@
+// SPDX-License-Identifier: GPL-3.0-only
+/*
+ *  nfuspire/src/connect.c
+ *
+ *  Copyright (C) Emily <info@emy.sh>
+ */
+
+#include <errno.h>
+#include <fuse.h>
+#include <nfuspire/connect.h>
+#include <nfuspire/info.h>
+#include <nfuspire/nspire.h>
+#include <nfuspire/prefetch.h>
+#include <nfuspire/stats.h>
+#include <nspire.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+int connect_device(nfuspire_ctx_t *ctx) {
+    int rc;
+    nspire_handle_t *handle = nullptr;
+    struct nspire_devinfo devinfo;
+
+    memset(&devinfo, 0, sizeof(devinfo));
+
+    rc = nspire_init(&handle);
+    if (rc != NSPIRE_ERR_SUCCESS) {
+        goto exit;
+    }
+
+    rc = nspire_device_info(handle, &devinfo);
+    if (rc != NSPIRE_ERR_SUCCESS) {
+        nspire_free(handle);
+        goto exit;
+    }
+
+exit:
+    pthread_mutex_lock(&ctx->devinfo_mutex);
+
+    if (rc == NSPIRE_ERR_SUCCESS) {
+        ctx->handle = handle;
+        ctx->devinfo = devinfo;
+        ctx->conn_state = NFUSPIRE_CONNECTED;
+    } else {
+        ctx->conn_error = nfuspire_error(rc);
+        ctx->conn_state = NFUSPIRE_FAILED;
+    }
+
+    pthread_cond_broadcast(&ctx->conn_cond);
+    info_notify(ctx);
+
+    pthread_mutex_unlock(&ctx->devinfo_mutex);
+    return rc;
+}
+
+static void *connect_worker(void *arg) {
+    connect_device((nfuspire_ctx_t *)arg);
+    return nullptr;
+}
+
+int connect_start(nfuspire_ctx_t *ctx) {
+    int rc;
+
+    if (!ctx->async_connect) {
+        return 0;
+    }
+
+    rc = pthread_create(&ctx->conn_thread, NULL, connect_worker, ctx);
+    if (rc) {
+        ctx->async_connect = false;
+        connect_device(ctx);
+        return -rc;
+    }
+
+    return 0;
+}
+
+void connect_stop(nfuspire_ctx_t *ctx) {
+    if (ctx->async_connect) {
+        pthread_join(ctx->conn_thread, NULL);
+    }
+}
+
+int connect_wait(nfuspire_ctx_t *ctx) {
+    int rc = 0;
+    uint64_t start = stats_now();
+
+    pthread_mutex_lock(&ctx->devinfo_mutex);
+
+    // The timeout runs on the monotonic clock, an interrupted request stops waiting before it's up
+    while (ctx->conn_state == NFUSPIRE_CONNECTING && stats_now() - start < ctx->conn_timeout * 1000UL) {
+        rc = nfuspire_wait(ctx, &ctx->conn_cond, &ctx->devinfo_mutex, start);
+        if (rc) {
+            pthread_mutex_unlock(&ctx->devinfo_mutex);
+            return rc;
+        }
+    }
+
+    switch (ctx->conn_state) {
+        case NFUSPIRE_CONNECTED:
+            rc = 0;
+            break;
+        case NFUSPIRE_FAILED:
+            rc = ctx->conn_error;
+            break;
+        default:
+            rc = -ETIMEDOUT;
+            break;
+    }
+
+    pthread_mutex_unlock(&ctx->devinfo_mutex);
+    return rc;
+}
+
+const char *connect_state_str(nfuspire_conn_state_t state) {
+    switch (state) {
+        case NFUSPIRE_CONNECTING:
+            return "connecting";
+        case NFUSPIRE_CONNECTED:
+            return "connected";
+        case NFUSPIRE_FAILED:
+            return "failed";
+        default:
+            return "unknown";
+    }
+}
+
+/*
+ * Requests only notice an interrupt while waiting, the statistics count
+ * how long a cancelled one had been waiting when it gave up. Transfers
+ * already handed to libnspire run to completion and aren't counted.
+ */
+bool nfuspire_interrupted(nfuspire_ctx_t *ctx, uint64_t start) {
+    if (!fuse_interrupted()) {
+        return false;
+    }
+
+    stats_cancelled(&ctx->stats, stats_now() - start);
+    return true;
+}
+
+static void nfuspire_poll_deadline(struct timespec *deadline) {
+    clock_gettime(CLOCK_REALTIME, deadline);
+    deadline->tv_nsec += DEVICE_LOCK_POLL_MS * 1000000;
+    if (deadline->tv_nsec >= 1000000000) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000;
+    }
+}
+
+int nfuspire_lock(nfuspire_ctx_t *ctx, pthread_mutex_t *mutex, uint64_t start) {
+    struct timespec deadline;
+    int rc;
+
+    for (;;) {
+        nfuspire_poll_deadline(&deadline);
+
+        rc = pthread_mutex_timedlock(mutex, &deadline);
+        if (rc != ETIMEDOUT) {
+            return -rc;
+        }
+
+        if (nfuspire_interrupted(ctx, start)) {
+            return -EINTR;
+        }
+    }
+}
+
+int nfuspire_wait(nfuspire_ctx_t *ctx, pthread_cond_t *cond, pthread_mutex_t *mutex, uint64_t start) {
+    struct timespec deadline;
+
+    nfuspire_poll_deadline(&deadline);
+
+    if (pthread_cond_timedwait(cond, mutex, &deadline) == ETIMEDOUT && nfuspire_interrupted(ctx, start)) {
+        return -EINTR;
+    }
+
+    return 0;
+}
+
+int nfuspire_device_lock(nfuspire_ctx_t *ctx) {
+    int rc;
+    uint64_t start;
+
+    rc = connect_wait(ctx);
+    if (rc) {
+        return rc;
+    }
+
+    prefetch_note_request(ctx);
+
+    /*
+     * A transfer can't be stopped once handed to libnspire, but waiting
+     * for the device and starting the next transfer can, so an
+     * interrupted request gives up here and leaves the device alone.
+     */
+    start = stats_now();
+
+    rc = nfuspire_lock(ctx, &ctx->mutex, start);
+    if (rc) {
+        return rc;
+    }
+
+    if (nfuspire_interrupted(ctx, start)) {
+        pthread_mutex_unlock(&ctx->mutex);
+        return -EINTR;
+    }
+
+    return 0;
+}
+
+void nfuspire_device_unlock(nfuspire_ctx_t *ctx) {
+    pthread_mutex_unlock(&ctx->mutex);
+}
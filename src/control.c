@@ -0,0 +1,191 @@
+// SPDX-License-Identifier: GPL-3.0-only
+/*
+ *  nfuspire/src/control.c
+ *
+ *  Copyright (C) Emily <info@emy.sh>
+ */
+
+#include <errno.h>
+#include <nfuspire/cache.h>
+#include <nfuspire/control.h>
+#include <nfuspire/devinfo.h>
+#include <nfuspire/nspire.h>
+#include <nfuspire/prefetch.h>
+#include <nfuspire/writeback.h>
+#include <nspire.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int control_prefetch_file(
+    nfuspire_ctx_t *ctx, const char *path, const struct nspire_dir_item *item, __attribute__((unused)) void *arg
+) {
+    int rc;
+    unsigned char *data;
+    size_t size;
+
+    if (item->type == NSPIRE_DIR || item->size > ctx->cache_maxsize) {
+        return 0;
+    }
+
+    rc = nfuspire_file_fetch(ctx, path, item, &data, &size);
+    if (!rc) {
+        free(data);
+    }
+
+    return rc;
+}
+
+static int control_prefetch(nfuspire_ctx_t *ctx, const char *path) {
+    int rc;
+    struct nspire_dir_item item;
+    unsigned char *data;
+    size_t size;
+
+    if (!path) {
+        return -EINVAL;
+    }
+
+    path += strspn(path, " \t");
+    if (path[0] != '/') {
+        return -EINVAL;
+    }
+
+    rc = nfuspire_attr(ctx, path, &item);
+    if (rc) {
+        return rc;
+    }
+
+    if (item.type == NSPIRE_DIR) {
+        return nfuspire_walk(ctx, path, control_prefetch_file, nullptr);
+    }
+
+    rc = nfuspire_file_fetch(ctx, path, &item, &data, &size);
+    if (!rc) {
+        free(data);
+    }
+
+    return rc;
+}
+
+static int control_set(nfuspire_ctx_t *ctx, const char *key, const char *value) {
+    unsigned long number;
+    char *end;
+
+    if (!key || !value) {
+        return -EINVAL;
+    }
+
+    errno = 0;
+    number = strtoul(value, &end, 0);
+    if (errno || *end || end == value) {
+        return -EINVAL;
+    }
+
+    if (strcmp(key, "cache_ttl") == 0) {
+        cache_set_ttl(ctx, number);
+    } else if (strcmp(key, "cache_size") == 0) {
+        cache_set_maxsize(ctx, number);
+    } else if (strcmp(key, "devinfo_refresh") == 0) {
+        return devinfo_set_interval(ctx, number);
+    } else if (strcmp(key, "upload_delay") == 0) {
+        return writeback_set_delay(ctx, number);
+    } else if (strcmp(key, "prefetch_size") == 0) {
+        return prefetch_set_size(ctx, number);
+    } else if (strcmp(key, "index_ttl") == 0) {
+        pthread_mutex_lock(&ctx->index_mutex);
+        ctx->index_ttl = number;
+        pthread_mutex_unlock(&ctx->index_mutex);
+    } else if (strcmp(key, "connect_timeout") == 0) {
+        pthread_mutex_lock(&ctx->devinfo_mutex);
+        ctx->conn_timeout = number;
+        pthread_mutex_unlock(&ctx->devinfo_mutex);
+    } else {
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+static int control_exec(nfuspire_ctx_t *ctx, char *line) {
+    char *cmd, *save;
+
+    cmd = strtok_r(line, " \t\r", &save);
+    if (!cmd || cmd[0] == '#') {
+        return 0;
+    }
+
+    if (strcmp(cmd, "flush") == 0) {
+        return writeback_flush(ctx);
+    } else if (strcmp(cmd, "drop") == 0) {
+        cache_drop(ctx);
+        return 0;
+    } else if (strcmp(cmd, "prefetch") == 0) {
+        return control_prefetch(ctx, strtok_r(nullptr, "\r\n", &save));
+    } else if (strcmp(cmd, "set") == 0) {
+        char *key = strtok_r(nullptr, " \t\r", &save);
+        return control_set(ctx, key, strtok_r(nullptr, " \t\r", &save));
+    }
+
+    return -EINVAL;
+}
+
+int control_open(struct fuse_file_info *fi) {
+    // Every write is a command, never let the kernel cache or merge them
+    fi->direct_io = 1;
+    return 0;
+}
+
+int control_read(char *buf, size_t size, off_t offset) {
+    nfuspire_ctx_t *ctx = current_nfuspire_ctx;
+    char data[CONTROL_DATA_SIZE];
+    size_t len;
+    unsigned int upload_failed;
+    int upload_error;
+
+    upload_failed = writeback_failed(ctx, &upload_error);
+
+    snprintf(
+        data, sizeof(data),
+        "cache_ttl %u\n"
+        "cache_size %lu\n"
+        "devinfo_refresh %u\n"
+        "upload_delay %u\n"
+        "connect_timeout %u\n"
+        "prefetch_size %lu\n"
+        "index_ttl %u\n"
+        "upload_failed %u\n"
+        "upload_error %d\n",
+        ctx->cache_ttl, ctx->cache_maxsize, ctx->devinfo_interval, ctx->upload_delay, ctx->conn_timeout,
+        ctx->prefetch_size, ctx->index_ttl, upload_failed, -upload_error
+    );
+
+    len = strlen(data);
+
+    if (offset < 0 || (size_t)offset >= len)
+        return 0;
+
+    if (offset + size > len)
+        size = len - offset;
+
+    memcpy(buf, data + offset, size);
+    return size;
+}
+
+int control_write(const char *buf, size_t size) {
+    nfuspire_ctx_t *ctx = current_nfuspire_ctx;
+    char *commands, *line, *save;
+    int rc = 0;
+
+    commands = strndup(buf, size);
+    if (!commands) {
+        return -ENOMEM;
+    }
+
+    for (line = strtok_r(commands, "\n", &save); line && !rc; line = strtok_r(nullptr, "\n", &save)) {
+        rc = control_exec(ctx, line);
+    }
+
+    free(commands);
+    return rc ? rc : (int)size;
+}
@@ -0,0 +1,178 @@
+// SPDX-License-Identifier: GPL-3.0-only
+/*
+ *  nfuspire/src/devinfo.c
+ *
+ *  Copyright (C) Emily <info@emy.sh>
+ */
+
+#include <errno.h>
+#include <nfuspire/devinfo.h>
+#include <nfuspire/info.h>
+#include <nfuspire/nspire.h>
+#include <nspire.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+static void devinfo_update_locked(nfuspire_ctx_t *ctx, const struct nspire_devinfo *devinfo) {
+    if (memcmp(&ctx->devinfo, devinfo, sizeof(*devinfo)) == 0) {
+        return;
+    }
+
+    ctx->devinfo = *devinfo;
+    info_notify(ctx);
+}
+
+static void *devinfo_worker(void *arg) {
+    nfuspire_ctx_t *ctx = arg;
+    struct nspire_devinfo devinfo;
+    struct timespec deadline;
+    unsigned long wait_ms;
+    int rc;
+
+    pthread_mutex_lock(&ctx->devinfo_mutex);
+
+    while (ctx->devinfo_running) {
+        // Paused until someone sets an interval again
+        if (!ctx->devinfo_interval && !ctx->devinfo_stale) {
+            pthread_cond_wait(&ctx->devinfo_cond, &ctx->devinfo_mutex);
+            continue;
+        }
+
+        wait_ms = ctx->devinfo_stale ? DEVINFO_RETRY_MS : ctx->devinfo_interval * 1000UL;
+
+        // devinfo_cond waits on the monotonic clock, setting the wall clock doesn't skip or stall a refresh
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += wait_ms / 1000;
+        deadline.tv_nsec += (wait_ms % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+
+        rc = pthread_cond_timedwait(&ctx->devinfo_cond, &ctx->devinfo_mutex, &deadline);
+        if (!ctx->devinfo_running) {
+            break;
+        }
+
+        // Woken up early, recompute the deadline
+        if (rc != ETIMEDOUT) {
+            continue;
+        }
+
+        if (ctx->conn_state != NFUSPIRE_CONNECTED) {
+            continue;
+        }
+
+        pthread_mutex_unlock(&ctx->devinfo_mutex);
+
+        // Refreshing is low priority, never make a user request wait for the device
+        if (pthread_mutex_trylock(&ctx->mutex) != 0) {
+            pthread_mutex_lock(&ctx->devinfo_mutex);
+            ctx->devinfo_stale = true;
+            continue;
+        }
+
+        memset(&devinfo, 0, sizeof(devinfo));
+        rc = nspire_device_info(ctx->handle, &devinfo);
+
+        pthread_mutex_unlock(&ctx->mutex);
+        pthread_mutex_lock(&ctx->devinfo_mutex);
+
+        ctx->devinfo_stale = false;
+        if (!rc) {
+            devinfo_update_locked(ctx, &devinfo);
+        }
+    }
+
+    pthread_mutex_unlock(&ctx->devinfo_mutex);
+    return nullptr;
+}
+
+int devinfo_start(nfuspire_ctx_t *ctx) {
+    int rc;
+
+    if (!ctx->devinfo_interval) {
+        return 0;
+    }
+
+    ctx->devinfo_running = true;
+
+    rc = pthread_create(&ctx->devinfo_thread, NULL, devinfo_worker, ctx);
+    if (rc) {
+        ctx->devinfo_running = false;
+        return -rc;
+    }
+
+    return 0;
+}
+
+void devinfo_stop(nfuspire_ctx_t *ctx) {
+    pthread_mutex_lock(&ctx->devinfo_mutex);
+
+    if (!ctx->devinfo_running) {
+        pthread_mutex_unlock(&ctx->devinfo_mutex);
+        return;
+    }
+
+    ctx->devinfo_running = false;
+    pthread_cond_broadcast(&ctx->devinfo_cond);
+    pthread_mutex_unlock(&ctx->devinfo_mutex);
+
+    pthread_join(ctx->devinfo_thread, NULL);
+}
+
+int devinfo_set_interval(nfuspire_ctx_t *ctx, unsigned int interval) {
+    int rc = 0;
+
+    pthread_mutex_lock(&ctx->devinfo_mutex);
+
+    ctx->devinfo_interval = interval;
+    pthread_cond_signal(&ctx->devinfo_cond);
+
+    // Started under the lock, two settings at once can't both start a thread
+    if (!ctx->devinfo_running) {
+        rc = devinfo_start(ctx);
+    }
+
+    pthread_mutex_unlock(&ctx->devinfo_mutex);
+    return rc;
+}
+
+void devinfo_get(nfuspire_ctx_t *ctx, struct nspire_devinfo *devinfo) {
+    pthread_mutex_lock(&ctx->devinfo_mutex);
+    *devinfo = ctx->devinfo;
+    pthread_mutex_unlock(&ctx->devinfo_mutex);
+}
+
+void devinfo_storage_used(nfuspire_ctx_t *ctx, int64_t delta) {
+    struct nspire_devinfo devinfo;
+
+    if (!delta) {
+        return;
+    }
+
+    pthread_mutex_lock(&ctx->devinfo_mutex);
+
+    devinfo = ctx->devinfo;
+
+    if (delta > 0) {
+        devinfo.storage.free = devinfo.storage.free > (uint64_t)delta ? devinfo.storage.free - delta : 0;
+    } else {
+        devinfo.storage.free += -delta;
+        if (devinfo.storage.free > devinfo.storage.total) {
+            devinfo.storage.free = devinfo.storage.total;
+        }
+    }
+
+    devinfo_update_locked(ctx, &devinfo);
+
+    pthread_mutex_unlock(&ctx->devinfo_mutex);
+}
+
+void devinfo_invalidate(nfuspire_ctx_t *ctx) {
+    pthread_mutex_lock(&ctx->devinfo_mutex);
+    ctx->devinfo_stale = true;
+    pthread_cond_signal(&ctx->devinfo_cond);
+    pthread_mutex_unlock(&ctx->devinfo_mutex);
+}
@@ -0,0 +1,195 @@
+// SPDX-License-Identifier: GPL-3.0-only
+/*
+ *  nfuspire/src/flight.c
+ *
+ *  Copyright (C) Emily <info@emy.sh>
+ */
+
+#include <errno.h>
+#include <nfuspire/connect.h>
+#include <nfuspire/flight.h>
+#include <nfuspire/nspire.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+// ctx->flights_mutex must be held
+static void flight_put(flight_t *flight) {
+    if (--flight->refs) {
+        return;
+    }
+
+    pthread_cond_destroy(&flight->cond);
+    free(flight->data);
+    free(flight->path);
+    free(flight);
+}
+
+// ctx->flights_mutex must be held, requests started before an invalidation don't count
+static flight_t *flight_find(
+    nfuspire_ctx_t *ctx, flight_op_t op, const char *path, uint64_t size, uint64_t date, uint64_t generation
+) {
+    for (flight_t *flight = ctx->flights; flight; flight = flight->next) {
+        if (flight->op == op && flight->size == size && flight->date == date && flight->generation == generation &&
+            strcmp(flight->path, path) == 0) {
+            return flight;
+        }
+    }
+
+    return nullptr;
+}
+
+// ctx->flights_mutex must be held
+static int flight_wait(nfuspire_ctx_t *ctx, flight_t *flight) {
+    uint64_t start = stats_now();
+    int rc = 0;
+
+    while (!flight->done && !rc) {
+        rc = nfuspire_wait(ctx, &flight->cond, &ctx->flights_mutex, start);
+    }
+
+    return rc;
+}
+
+// ctx->flights_mutex must be held
+static flight_t *flight_create(
+    nfuspire_ctx_t *ctx, flight_op_t op, const char *path, uint64_t size, uint64_t date, uint64_t generation,
+    bool prefetch
+) {
+    flight_t *flight;
+
+    flight = calloc(1, sizeof(flight_t));
+    if (!flight) {
+        return nullptr;
+    }
+
+    flight->path = strdup(path);
+    if (!flight->path) {
+        free(flight);
+        return nullptr;
+    }
+
+    flight->op = op;
+    flight->size = size;
+    flight->date = date;
+    flight->generation = generation;
+    flight->prefetch = prefetch;
+    flight->refs = 1;
+    pthread_cond_init(&flight->cond, NULL);
+
+    flight->next = ctx->flights;
+    ctx->flights = flight;
+    return flight;
+}
+
+/*
+ * Either hands out the result of an identical request already talking
+ * to the device, leaving *flight empty, or registers the caller as the
+ * one performing it, who then has to call flight_land.
+ */
+int flight_join(
+    nfuspire_ctx_t *ctx, flight_op_t op, const char *path, uint64_t size, uint64_t date, uint64_t generation,
+    flight_t **flight, void **data, size_t *data_size
+) {
+    flight_t *found;
+    int rc;
+
+    *flight = nullptr;
+
+    pthread_mutex_lock(&ctx->flights_mutex);
+
+    for (;;) {
+        found = flight_find(ctx, op, path, size, date, generation);
+        if (!found) {
+            break;
+        }
+
+        found->refs++;
+
+        rc = flight_wait(ctx, found);
+        if (!rc) {
+            rc = found->rc;
+        }
+
+        // Only the one performing the request was interrupted, someone else takes over
+        if (found->done && found->rc == -EINTR) {
+            flight_put(found);
+            continue;
+        }
+
+        if (!rc) {
+            *data = malloc(found->data_size ? found->data_size : 1);
+            if (*data) {
+                memcpy(*data, found->data, found->data_size);
+                *data_size = found->data_size;
+                stats_shared(&ctx->stats);
+
+                if (found->prefetch) {
+                    stats_prefetch_hit(&ctx->stats);
+                }
+            } else {
+                rc = -ENOMEM;
+            }
+        }
+
+        flight_put(found);
+        pthread_mutex_unlock(&ctx->flights_mutex);
+        return rc;
+    }
+
+    found = flight_create(ctx, op, path, size, date, generation, false);
+    rc = found ? 0 : -ENOMEM;
+
+    *flight = found;
+
+    pthread_mutex_unlock(&ctx->flights_mutex);
+    return rc;
+}
+
+// Starts a request only if no identical one is in flight, without ever waiting
+flight_t *flight_begin(
+    nfuspire_ctx_t *ctx, flight_op_t op, const char *path, uint64_t size, uint64_t date, uint64_t generation,
+    bool prefetch
+) {
+    flight_t *flight = nullptr;
+
+    pthread_mutex_lock(&ctx->flights_mutex);
+
+    if (!flight_find(ctx, op, path, size, date, generation)) {
+        flight = flight_create(ctx, op, path, size, date, generation, prefetch);
+    }
+
+    pthread_mutex_unlock(&ctx->flights_mutex);
+    return flight;
+}
+
+void flight_land(nfuspire_ctx_t *ctx, flight_t *flight, int rc, const void *data, size_t data_size) {
+    flight_t **it;
+
+    pthread_mutex_lock(&ctx->flights_mutex);
+
+    for (it = &ctx->flights; *it; it = &(*it)->next) {
+        if (*it == flight) {
+            *it = flight->next;
+            break;
+        }
+    }
+
+    // Copied only when someone is actually waiting for it
+    if (!rc && flight->refs > 1) {
+        flight->data = malloc(data_size ? data_size : 1);
+        if (flight->data) {
+            memcpy(flight->data, data, data_size);
+            flight->data_size = data_size;
+        } else {
+            rc = -ENOMEM;
+        }
+    }
+
+    flight->rc = rc;
+    flight->done = true;
+    pthread_cond_broadcast(&flight->cond);
+
+    flight_put(flight);
+    pthread_mutex_unlock(&ctx->flights_mutex);
+}
@@ -0,0 +1,744 @@
+// SPDX-License-Identifier: GPL-3.0-only
+/*
+ *  nfuspire/src/import.c
+ *
+ *  Copyright (C) Emily <info@emy.sh>
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <nfuspire/cache.h>
+#include <nfuspire/connect.h>
+#include <nfuspire/devinfo.h>
+#include <nfuspire/import.h>
+#include <nfuspire/nspire.h>
+#include <nfuspire/tar.h>
+#include <nspire.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+typedef struct import_entry {
+    struct import_entry *next;
+    char path[PATH_MAX];
+    char type;
+    time_t mtime;
+    size_t size;
+    unsigned char data[];
+} import_entry_t;
+
+typedef enum import_state {
+    IMPORT_HEADER,
+    IMPORT_DATA,
+    IMPORT_END,
+    IMPORT_FAILED,
+} import_state_t;
+
+/*
+ * The archive is parsed as it is written, and every complete entry is
+ * queued for a thread uploading it, so the next entry arrives while the
+ * previous one is still being sent to the device.
+ */
+typedef struct import_stream {
+    nfuspire_ctx_t *ctx;
+    pthread_t thread;
+
+    // Queue and status
+    pthread_mutex_t mutex;
+    pthread_cond_t data_cond;
+    pthread_cond_t space_cond;
+    import_entry_t *head;
+    import_entry_t *tail;
+    size_t queued;
+    bool closed;
+    bool finished;
+    unsigned long entries;
+    unsigned long uploaded;
+    unsigned long skipped;
+    unsigned long failed;
+    unsigned long dirs_created;
+    char *errors;
+    size_t errors_len;
+    unsigned long errors_dropped;
+
+    // Parser, only used by writes
+    pthread_mutex_t parse_mutex;
+    import_state_t state;
+    int parse_error;
+    off_t offset;
+    unsigned char block[TAR_BLOCK_SIZE];
+    size_t block_len;
+    import_entry_t *entry;
+    uint64_t received;
+    uint64_t total;
+    char longname[PATH_MAX];
+    bool has_longname;
+
+    // Directories known to exist, only used by the upload thread
+    char **dirs;
+    size_t num_dirs;
+} import_stream_t;
+
+static void import_log(import_stream_t *import, const char *path, const char *message) {
+    char line[PATH_MAX + 128];
+    int len;
+
+    len = snprintf(line, sizeof(line), "error %s: %s\n", path, message);
+
+    pthread_mutex_lock(&import->mutex);
+
+    import->failed++;
+
+    // The counters have to fit next to the log
+    if (import->errors_len + len > IMPORT_STATUS_SIZE / 2) {
+        import->errors_dropped++;
+    } else {
+        memcpy(import->errors + import->errors_len, line, len + 1);
+        import->errors_len += len;
+    }
+
+    pthread_mutex_unlock(&import->mutex);
+}
+
+static void import_count(import_stream_t *import, unsigned long *counter) {
+    pthread_mutex_lock(&import->mutex);
+    (*counter)++;
+    pthread_mutex_unlock(&import->mutex);
+}
+
+static bool import_dir_known(import_stream_t *import, const char *path) {
+    for (size_t i = 0; i < import->num_dirs; i++) {
+        if (strcmp(import->dirs[i], path) == 0) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static void import_dir_add(import_stream_t *import, const char *path) {
+    char **dirs;
+    char *dir;
+
+    dir = strdup(path);
+    if (!dir) {
+        return;
+    }
+
+    dirs = realloc(import->dirs, (import->num_dirs + 1) * sizeof(char *));
+    if (!dirs) {
+        free(dir);
+        return;
+    }
+
+    import->dirs = dirs;
+    import->dirs[import->num_dirs++] = dir;
+}
+
+static int import_mkdir(import_stream_t *import, const char *dir) {
+    nfuspire_ctx_t *ctx = import->ctx;
+    struct nspire_dir_item item;
+    int rc;
+
+    if (import_dir_known(import, dir)) {
+        return 0;
+    }
+
+    rc = nfuspire_attr(ctx, dir, &item);
+    if (!rc && item.type != NSPIRE_DIR) {
+        return -ENOTDIR;
+    }
+
+    if (rc == -ENOENT) {
+        rc = nfuspire_device_lock(ctx);
+        if (rc) {
+            return rc;
+        }
+
+        rc = nspire_dir_create(ctx->handle, dir);
+
+        nfuspire_device_unlock(ctx);
+
+        if (rc) {
+            return nfuspire_error(rc);
+        }
+
+        cache_invalidate(ctx, dir);
+        import_count(import, &import->dirs_created);
+    } else if (rc) {
+        return rc;
+    }
+
+    import_dir_add(import, dir);
+    return 0;
+}
+
+// Creates every missing directory leading up to and including path
+static int import_mkdirs(import_stream_t *import, const char *path) {
+    char dir[PATH_MAX];
+    char *slash;
+    int rc;
+
+    snprintf(dir, sizeof(dir), "%s", path);
+
+    for (slash = strchr(dir + 1, '/'); slash; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        rc = import_mkdir(import, dir);
+        *slash = '/';
+
+        if (rc) {
+            return rc;
+        }
+    }
+
+    return import_mkdir(import, dir);
+}
+
+static int import_upload(import_stream_t *import, import_entry_t *entry) {
+    nfuspire_ctx_t *ctx = import->ctx;
+    struct nspire_dir_item item;
+    char parent[PATH_MAX];
+    char *slash;
+    uint64_t device_size = 0;
+    int rc;
+
+    snprintf(parent, sizeof(parent), "%s", entry->path);
+    slash = strrchr(parent, '/');
+    if (slash && slash != parent) {
+        *slash = '\0';
+
+        rc = import_mkdirs(import, parent);
+        if (rc) {
+            return rc;
+        }
+    }
+
+    rc = nfuspire_attr(ctx, entry->path, &item);
+    if (!rc) {
+        if (item.type == NSPIRE_DIR) {
+            return -EISDIR;
+        }
+
+        /*
+         * Uploads can't carry a date, so a device copy is current when
+         * it has the same size and isn't older than the archived one.
+         */
+        if (item.size == entry->size && item.date >= (uint64_t)entry->mtime) {
+            import_count(import, &import->skipped);
+            return 0;
+        }
+
+        device_size = item.size;
+    } else if (rc != -ENOENT) {
+        return rc;
+    }
+
+    rc = nfuspire_device_lock(ctx);
+    if (rc) {
+        return rc;
+    }
+
+    rc = nspire_file_write(ctx->handle, entry->path, entry->data, entry->size);
+
+    nfuspire_device_unlock(ctx);
+
+    if (rc) {
+        return nfuspire_error(rc);
+    }
+
+    cache_invalidate(ctx, entry->path);
+    devinfo_storage_used(ctx, (int64_t)entry->size - (int64_t)device_size);
+    import_count(import, &import->uploaded);
+    return 0;
+}
+
+static void *import_worker(void *arg) {
+    import_stream_t *import = arg;
+    import_entry_t *entry;
+    int rc;
+
+    pthread_mutex_lock(&import->mutex);
+
+    for (;;) {
+        while (!import->head && !import->closed) {
+            pthread_cond_wait(&import->data_cond, &import->mutex);
+        }
+
+        entry = import->head;
+        if (!entry) {
+            break;
+        }
+
+        import->head = entry->next;
+        if (!import->head) {
+            import->tail = nullptr;
+        }
+
+        pthread_mutex_unlock(&import->mutex);
+
+        if (entry->type == TAR_TYPE_DIR) {
+            rc = import_mkdirs(import, entry->path);
+        } else {
+            rc = import_upload(import, entry);
+        }
+
+        // A failed entry is reported and the rest of the archive still goes through
+        if (rc) {
+            import_log(import, entry->path, strerror(-rc));
+        }
+
+        pthread_mutex_lock(&import->mutex);
+
+        // Only now, the entry being uploaded counts against the queue as well
+        import->queued -= entry->size;
+        pthread_cond_signal(&import->space_cond);
+        free(entry);
+    }
+
+    import->finished = true;
+    pthread_mutex_unlock(&import->mutex);
+
+    return nullptr;
+}
+
+static int import_push(import_stream_t *import, import_entry_t *entry) {
+    uint64_t start = stats_now();
+    int rc;
+
+    pthread_mutex_lock(&import->mutex);
+
+    while (import->head && import->queued + entry->size > IMPORT_QUEUE_MAX) {
+        rc = nfuspire_wait(import->ctx, &import->space_cond, &import->mutex, start);
+        if (rc) {
+            pthread_mutex_unlock(&import->mutex);
+            free(entry);
+            return rc;
+        }
+    }
+
+    if (import->tail) {
+        import->tail->next = entry;
+    } else {
+        import->head = entry;
+    }
+
+    import->tail = entry;
+    import->queued += entry->size;
+
+    pthread_cond_signal(&import->data_cond);
+    pthread_mutex_unlock(&import->mutex);
+    return 0;
+}
+
+// Maps an archive member onto the device, refusing anything escaping the root
+static bool import_path(const char *name, char *path, size_t size) {
+    size_t len;
+
+    while (name[0] == '/' || (name[0] == '.' && name[1] == '/')) {
+        name += name[0] == '/' ? 1 : 2;
+    }
+
+    snprintf(path, size, "/%s", name);
+
+    len = strlen(path);
+    while (len > 1 && path[len - 1] == '/') {
+        path[--len] = '\0';
+    }
+
+    for (const char *it = path; (it = strstr(it, "/..")); it += 3) {
+        if (it[3] == '\0' || it[3] == '/') {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static int import_header(import_stream_t *import) {
+    const tar_header_t *header = (const tar_header_t *)import->block;
+    char name[PATH_MAX];
+    uint64_t size;
+    char type;
+
+    if (tar_header_zero(header)) {
+        import->state = IMPORT_END;
+        return 0;
+    }
+
+    if (!tar_header_valid(header)) {
+        import_log(import, "archive", "invalid tar header");
+        return -EINVAL;
+    }
+
+    type = header->typeflag;
+    size = tar_number(header->size, sizeof(header->size));
+
+    if (import->has_longname) {
+        snprintf(name, sizeof(name), "%s", import->longname);
+        import->has_longname = false;
+    } else {
+        tar_name(header, name, sizeof(name));
+    }
+
+    import->entry = nullptr;
+    import->received = 0;
+    import->total = size + TAR_PADDING(size);
+    import->state = IMPORT_DATA;
+
+    switch (type) {
+        case TAR_TYPE_LONGNAME:
+        case TAR_TYPE_PAX:
+            if (size >= IMPORT_META_MAX) {
+                import_log(import, "archive", "extended header too large");
+                return -EINVAL;
+            }
+
+            import->entry = calloc(1, sizeof(import_entry_t) + size + 1);
+            if (!import->entry) {
+                return -ENOMEM;
+            }
+
+            break;
+        case TAR_TYPE_PAXGLOBAL:
+            break;
+        case TAR_TYPE_FILE:
+        case TAR_TYPE_OLDFILE:
+        case TAR_TYPE_CONTIG:
+        case TAR_TYPE_DIR:
+            if (type == TAR_TYPE_DIR) {
+                size = 0;
+            }
+
+            import->entry = calloc(1, sizeof(import_entry_t) + size);
+            if (!import->entry) {
+                import_count(import, &import->entries);
+                import_log(import, name, strerror(ENOMEM));
+                break;
+            }
+
+            if (!import_path(name, import->entry->path, sizeof(import->entry->path))) {
+                import_count(import, &import->entries);
+                import_log(import, name, "path outside of the device");
+                free(import->entry);
+                import->entry = nullptr;
+                break;
+            }
+
+            // The root itself is often archived as "./"
+            if (strcmp(import->entry->path, "/") == 0) {
+                free(import->entry);
+                import->entry = nullptr;
+                break;
+            }
+
+            import_count(import, &import->entries);
+            break;
+        default:
+            import_count(import, &import->entries);
+            import_log(import, name, "unsupported entry type");
+            break;
+    }
+
+    if (import->entry) {
+        import->entry->type = type == TAR_TYPE_OLDFILE || type == TAR_TYPE_CONTIG ? TAR_TYPE_FILE : type;
+        import->entry->size = size;
+        import->entry->mtime = (time_t)tar_number(header->mtime, sizeof(header->mtime));
+    }
+
+    return 0;
+}
+
+static int import_entry_done(import_stream_t *import) {
+    import_entry_t *entry = import->entry;
+
+    import->entry = nullptr;
+    import->state = IMPORT_HEADER;
+
+    if (!entry) {
+        return 0;
+    }
+
+    switch (entry->type) {
+        case TAR_TYPE_LONGNAME:
+            snprintf(import->longname, sizeof(import->longname), "%s", (const char *)entry->data);
+            import->has_longname = true;
+            free(entry);
+            return 0;
+        case TAR_TYPE_PAX:
+            import->has_longname = tar_pax_path(
+                (const char *)entry->data, entry->size, import->longname, sizeof(import->longname)
+            );
+            free(entry);
+            return 0;
+        default:
+            return import_push(import, entry);
+    }
+}
+
+int import_open(struct fuse_file_info *fi) {
+    nfuspire_ctx_t *ctx = current_nfuspire_ctx;
+    import_stream_t *import;
+    int rc;
+
+    if ((fi->flags & O_ACCMODE) != O_WRONLY) {
+        return -EACCES;
+    }
+
+    import = calloc(1, sizeof(import_stream_t));
+    if (!import) {
+        return -ENOMEM;
+    }
+
+    import->errors = calloc(1, IMPORT_STATUS_SIZE / 2 + 1);
+    if (!import->errors) {
+        free(import);
+        return -ENOMEM;
+    }
+
+    import->ctx = ctx;
+    pthread_mutex_init(&import->mutex, NULL);
+    pthread_mutex_init(&import->parse_mutex, NULL);
+    pthread_cond_init(&import->data_cond, NULL);
+    pthread_cond_init(&import->space_cond, NULL);
+
+    pthread_mutex_lock(&ctx->import_mutex);
+
+    // One import at a time, the status file only describes the latest one
+    if (ctx->import && !ctx->import->finished) {
+        rc = -EBUSY;
+        goto exit;
+    }
+
+    rc = pthread_create(&import->thread, NULL, import_worker, import);
+    if (rc) {
+        rc = -rc;
+        goto exit;
+    }
+
+    import_stop(ctx);
+    ctx->import = import;
+
+    fi->direct_io = 1;
+    fi->nonseekable = 1;
+    fi->fh = (typeof(fi->fh))import;
+
+exit:
+    pthread_mutex_unlock(&ctx->import_mutex);
+
+    if (rc) {
+        free(import->errors);
+        free(import);
+    }
+
+    return rc;
+}
+
+int import_write(const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+    import_stream_t *import = (import_stream_t *)(fi->fh);
+    size_t done = 0, len;
+    uint64_t data_len;
+    int rc = 0;
+
+    if (!import) {
+        return -EINVAL;
+    }
+
+    pthread_mutex_lock(&import->parse_mutex);
+
+    if (import->state == IMPORT_FAILED) {
+        rc = import->parse_error;
+        goto exit;
+    }
+
+    if (offset != import->offset) {
+        rc = -ESPIPE;
+        goto exit;
+    }
+
+    while (done < size && !rc) {
+        switch (import->state) {
+            case IMPORT_HEADER:
+                len = TAR_BLOCK_SIZE - import->block_len;
+                if (len > size - done) {
+                    len = size - done;
+                }
+
+                memcpy(import->block + import->block_len, buf + done, len);
+                import->block_len += len;
+                done += len;
+
+                if (import->block_len == TAR_BLOCK_SIZE) {
+                    import->block_len = 0;
+                    rc = import_header(import);
+                    if (!rc && import->state == IMPORT_DATA && !import->total) {
+                        rc = import_entry_done(import);
+                    }
+                }
+
+                break;
+            case IMPORT_DATA:
+                len = import->total - import->received;
+                if (len > size - done) {
+                    len = size - done;
+                }
+
+                // Everything past the entry's own size is padding
+                if (import->entry && import->received < import->entry->size) {
+                    data_len = import->entry->size - import->received;
+                    memcpy(
+                        import->entry->data + import->received, buf + done, data_len < len ? data_len : len
+                    );
+                }
+
+                import->received += len;
+                done += len;
+
+                if (import->received == import->total) {
+                    rc = import_entry_done(import);
+                }
+
+                break;
+            case IMPORT_END:
+                // Trailing blocks after the end of the archive are ignored
+                done = size;
+                break;
+            case IMPORT_FAILED:
+                rc = import->parse_error;
+                break;
+        }
+    }
+
+    if (rc && import->state != IMPORT_FAILED) {
+        if (rc == -EINTR) {
+            import_log(import, "archive", "import interrupted");
+        }
+
+        free(import->entry);
+        import->entry = nullptr;
+        import->state = IMPORT_FAILED;
+        import->parse_error = rc;
+    }
+
+    if (!rc) {
+        import->offset += size;
+        rc = size;
+    }
+
+exit:
+    pthread_mutex_unlock(&import->parse_mutex);
+    return rc;
+}
+
+int import_release(struct fuse_file_info *fi) {
+    import_stream_t *import = (import_stream_t *)(fi->fh);
+
+    if (!import) {
+        return -EINVAL;
+    }
+
+    pthread_mutex_lock(&import->parse_mutex);
+
+    if (import->state == IMPORT_DATA || (import->state == IMPORT_HEADER && import->block_len)) {
+        import_log(import, "archive", "truncated archive");
+    }
+
+    free(import->entry);
+    import->entry = nullptr;
+
+    pthread_mutex_unlock(&import->parse_mutex);
+
+    // Whatever is queued still gets uploaded, the status file tells when it's done
+    pthread_mutex_lock(&import->mutex);
+    import->closed = true;
+    pthread_cond_signal(&import->data_cond);
+    pthread_mutex_unlock(&import->mutex);
+
+    fi->fh = 0;
+    return 0;
+}
+
+int import_status_read(char *buf, size_t size, off_t offset) {
+    nfuspire_ctx_t *ctx = current_nfuspire_ctx;
+    import_stream_t *import;
+    char data[IMPORT_STATUS_SIZE];
+    size_t len;
+
+    pthread_mutex_lock(&ctx->import_mutex);
+
+    import = ctx->import;
+    if (!import) {
+        snprintf(data, sizeof(data), "state idle\n");
+    } else {
+        pthread_mutex_lock(&import->mutex);
+
+        len = snprintf(
+            data, sizeof(data),
+            "state %s\n"
+            "entries %lu\n"
+            "uploaded %lu\n"
+            "skipped %lu\n"
+            "failed %lu\n"
+            "directories_created %lu\n"
+            "%s",
+            import->finished ? "done" : "running", import->entries, import->uploaded, import->skipped, import->failed,
+            import->dirs_created, import->errors
+        );
+
+        if (import->errors_dropped && len < sizeof(data)) {
+            snprintf(data + len, sizeof(data) - len, "error ...: %lu more\n", import->errors_dropped);
+        }
+
+        pthread_mutex_unlock(&import->mutex);
+    }
+
+    pthread_mutex_unlock(&ctx->import_mutex);
+
+    len = strlen(data);
+
+    if (offset < 0 || (size_t)offset >= len) {
+        return 0;
+    }
+
+    if (offset + size > len) {
+        size = len - offset;
+    }
+
+    memcpy(buf, data + offset, size);
+    return size;
+}
+
+// ctx->import_mutex must be held, unless no more requests can come in
+void import_stop(nfuspire_ctx_t *ctx) {
+    import_stream_t *import = ctx->import;
+    import_entry_t *entry;
+
+    if (!import) {
+        return;
+    }
+
+    pthread_mutex_lock(&import->mutex);
+    import->closed = true;
+    pthread_cond_signal(&import->data_cond);
+    pthread_mutex_unlock(&import->mutex);
+
+    pthread_join(import->thread, NULL);
+
+    while ((entry = import->head)) {
+        import->head = entry->next;
+        free(entry);
+    }
+
+    for (size_t i = 0; i < import->num_dirs; i++) {
+        free(import->dirs[i]);
+    }
+
+    free(import->dirs);
+    free(import->entry);
+    free(import->errors);
+    free(import);
+
+    ctx->import = nullptr;
+}
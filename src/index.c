@@ -0,0 +1,249 @@
+// SPDX-License-Identifier: GPL-3.0-only
+/*
+ *  nfuspire/src/index.c
+ *
+ *  Copyright (C) Emily <info@emy.sh>
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <nfuspire/cache.h>
+#include <nfuspire/connect.h>
+#include <nfuspire/index.h>
+#include <nfuspire/nspire.h>
+#include <nspire.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct index_buf {
+    unsigned char *data;
+    size_t size;
+    size_t alloc;
+} index_buf_t;
+
+typedef struct index_walk {
+    index_buf_t text;
+    index_buf_t bin;
+    uint32_t count;
+} index_walk_t;
+
+static int index_append(index_buf_t *buf, const void *data, size_t size) {
+    unsigned char *new_data;
+    size_t alloc = buf->alloc ? buf->alloc : 4096;
+
+    while (buf->size + size > alloc) {
+        alloc *= 2;
+    }
+
+    if (alloc != buf->alloc) {
+        new_data = realloc(buf->data, alloc);
+        if (!new_data) {
+            return -ENOMEM;
+        }
+
+        buf->data = new_data;
+        buf->alloc = alloc;
+    }
+
+    memcpy(buf->data + buf->size, data, size);
+    buf->size += size;
+    return 0;
+}
+
+static void index_le(unsigned char *out, uint64_t value, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        out[i] = value >> (i * 8);
+    }
+}
+
+static int index_entry(
+    __attribute__((unused)) nfuspire_ctx_t *ctx, const char *path, const struct nspire_dir_item *item, void *arg
+) {
+    index_walk_t *walk = arg;
+    char line[PATH_MAX + 64];
+    unsigned char header[19];
+    size_t path_len = strlen(path);
+    int len, rc;
+
+    // The path goes last, so it may contain anything but a newline
+    len = snprintf(
+        line, sizeof(line), "%c %" PRIu64 " %" PRIu64 " %s\n", item->type == NSPIRE_DIR ? 'd' : 'f', item->size,
+        item->date, path
+    );
+
+    rc = index_append(&walk->text, line, len);
+    if (rc) {
+        return rc;
+    }
+
+    header[0] = item->type == NSPIRE_DIR ? INDEX_BIN_DIR : INDEX_BIN_FILE;
+    index_le(header + 1, item->size, 8);
+    index_le(header + 9, item->date, 8);
+    index_le(header + 17, path_len, 2);
+
+    rc = index_append(&walk->bin, header, sizeof(header));
+    if (!rc) {
+        rc = index_append(&walk->bin, path, path_len);
+    }
+
+    if (!rc) {
+        walk->count++;
+    }
+
+    return rc;
+}
+
+static int index_build(nfuspire_ctx_t *ctx, index_data_t **index) {
+    index_walk_t walk = {0};
+    int rc;
+
+    rc = index_append(&walk.bin, INDEX_BIN_MAGIC "\0\0\0\0", INDEX_BIN_MAGIC_LEN + 4);
+    if (rc) {
+        goto exit;
+    }
+
+    rc = nfuspire_walk(ctx, "/", index_entry, &walk);
+    if (rc) {
+        goto exit;
+    }
+
+    index_le(walk.bin.data + INDEX_BIN_MAGIC_LEN, walk.count, 4);
+
+    *index = calloc(1, sizeof(index_data_t));
+    if (!*index) {
+        rc = -ENOMEM;
+        goto exit;
+    }
+
+    (*index)->text = (char *)walk.text.data;
+    (*index)->text_size = walk.text.size;
+    (*index)->bin = walk.bin.data;
+    (*index)->bin_size = walk.bin.size;
+    return 0;
+
+exit:
+    free(walk.text.data);
+    free(walk.bin.data);
+    return rc;
+}
+
+// ctx->index_mutex must be held
+static void index_put(index_data_t *index) {
+    if (!index || --index->refs) {
+        return;
+    }
+
+    free(index->text);
+    free(index->bin);
+    free(index);
+}
+
+int index_open(struct fuse_file_info *fi) {
+    nfuspire_ctx_t *ctx = current_nfuspire_ctx;
+    index_data_t *index, *old;
+    uint64_t generation;
+    int rc;
+
+    if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+        return -EACCES;
+    }
+
+    // Concurrent readers of a stale index wait for a single rebuild, which can take a while
+    rc = nfuspire_lock(ctx, &ctx->index_build_mutex, stats_now());
+    if (rc) {
+        return rc;
+    }
+
+    generation = cache_generation(ctx);
+
+    pthread_mutex_lock(&ctx->index_mutex);
+
+    index = ctx->index;
+    if (index && index->generation == generation && stats_now() < index->built + ctx->index_ttl * 1000UL) {
+        index->refs++;
+    } else {
+        index = nullptr;
+    }
+
+    pthread_mutex_unlock(&ctx->index_mutex);
+
+    if (!index) {
+        // Changes made during the walk bump the generation, so they are picked up next time
+        rc = index_build(ctx, &index);
+        if (rc) {
+            goto exit;
+        }
+
+        index->generation = generation;
+        index->built = stats_now();
+        index->refs = 2;
+
+        pthread_mutex_lock(&ctx->index_mutex);
+        old = ctx->index;
+        ctx->index = index;
+        index_put(old);
+        pthread_mutex_unlock(&ctx->index_mutex);
+    }
+
+    // Rebuilt between opens, the size isn't known up front
+    fi->direct_io = 1;
+    fi->fh = (typeof(fi->fh))index;
+
+exit:
+    pthread_mutex_unlock(&ctx->index_build_mutex);
+    return rc;
+}
+
+int index_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+    index_data_t *index = (index_data_t *)(fi->fh);
+    const void *data;
+    size_t len;
+
+    if (!index) {
+        return -EINVAL;
+    }
+
+    if (strcmp(path, INDEX_BIN_PATH) == 0) {
+        data = index->bin;
+        len = index->bin_size;
+    } else {
+        data = index->text;
+        len = index->text_size;
+    }
+
+    if (offset < 0 || (size_t)offset >= len)
+        return 0;
+
+    if (offset + size > len)
+        size = len - offset;
+
+    memcpy(buf, (const char *)data + offset, size);
+    return size;
+}
+
+int index_release(struct fuse_file_info *fi) {
+    nfuspire_ctx_t *ctx = current_nfuspire_ctx;
+    index_data_t *index = (index_data_t *)(fi->fh);
+
+    if (!index) {
+        return -EINVAL;
+    }
+
+    pthread_mutex_lock(&ctx->index_mutex);
+    index_put(index);
+    pthread_mutex_unlock(&ctx->index_mutex);
+
+    fi->fh = 0;
+    return 0;
+}
+
+void index_free(nfuspire_ctx_t *ctx) {
+    pthread_mutex_lock(&ctx->index_mutex);
+    index_put(ctx->index);
+    ctx->index = nullptr;
+    pthread_mutex_unlock(&ctx->index_mutex);
+}
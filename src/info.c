@@ -8,13 +8,23 @@
 #include <errno.h>
 #include <fuse.h>
 #include <limits.h>
+#include <nfuspire/connect.h>
 #include <nfuspire/info.h>
 #include <nfuspire/nspire.h>
 #include <nspire.h>
+#include <poll.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+struct info_handle {
+    struct info_handle *next;
+    struct fuse_pollhandle *ph;
+    const char *name;
+    char data[INFO_DATA_SIZE];
+};
+
 static const char *info_files[] = {
     "storage_total",
     "storage_free",
@@ -44,141 +54,210 @@ static const char *info_files[] = {
     "extensions_os",
     "device_name",
     "electronic_id",
-    "runlevel"
+    "runlevel",
+    "connection"
 };
 
-int info_readdir(void *buf, fuse_fill_dir_t filler) {
-    filler(buf, ".", NULL, 0, 0);
-    filler(buf, "..", NULL, 0, 0);
-
-    for (size_t i = 0; i < sizeof(info_files) / sizeof(info_files[0]); i++) {
-        filler(buf, info_files[i], NULL, 0, 0);
+static const char *info_lookup(const char *path) {
+    if (strncmp(path, INFO_PATH_PREFIX, strlen(INFO_PATH_PREFIX)) != 0) {
+        return nullptr;
     }
 
-    return 0;
-}
+    path += strlen(INFO_PATH_PREFIX);
 
-int info_getattr(const char *path, struct stat *stbuf) {
     for (size_t i = 0; i < sizeof(info_files) / sizeof(info_files[0]); i++) {
-        char fullpath[PATH_MAX];
-        snprintf(fullpath, sizeof(fullpath), "/.well-known/info/%s", info_files[i]);
-
-        if (strcmp(path, fullpath) == 0) {
-            stbuf->st_mode = S_IFREG | 0444;
-            stbuf->st_nlink = 1;
-            stbuf->st_size = 1024;
-            stbuf->st_uid = getuid();
-            stbuf->st_gid = getgid();
-            return 0;
+        if (strcmp(path, info_files[i]) == 0) {
+            return info_files[i];
         }
     }
 
-    return -ENOENT;
+    return nullptr;
 }
 
-int info_read(const char *path, char *buf, size_t size, off_t offset) {
-    struct nspire_devinfo devinfo = current_nfuspire_ctx->devinfo;
-    char data[1024];
-
-    if (strcmp(path, "/.well-known/info/storage_total") == 0) {
-        snprintf(data, sizeof(data), "%lu\n", devinfo.storage.total);
-    } else if (strcmp(path, "/.well-known/info/storage_free") == 0) {
-        snprintf(data, sizeof(data), "%lu\n", devinfo.storage.free);
-    } else if (strcmp(path, "/.well-known/info/ram_total") == 0) {
-        snprintf(data, sizeof(data), "%lu\n", devinfo.ram.total);
-    } else if (strcmp(path, "/.well-known/info/ram_free") == 0) {
-        snprintf(data, sizeof(data), "%lu\n", devinfo.ram.free);
-    } else if (strcmp(path, "/.well-known/info/version_os_major") == 0) {
-        snprintf(data, sizeof(data), "%d\n", devinfo.versions[NSPIRE_VER_OS].major);
-    } else if (strcmp(path, "/.well-known/info/version_os_minor") == 0) {
-        snprintf(data, sizeof(data), "%d\n", devinfo.versions[NSPIRE_VER_OS].minor);
-    } else if (strcmp(path, "/.well-known/info/version_os_build") == 0) {
-        snprintf(data, sizeof(data), "%d\n", devinfo.versions[NSPIRE_VER_OS].build);
-    } else if (strcmp(path, "/.well-known/info/version_os") == 0) {
+static int info_render(const char *name, const nfuspire_ctx_t *ctx, char *data, size_t size) {
+    const struct nspire_devinfo *devinfo = &ctx->devinfo;
+
+    if (strcmp(name, "storage_total") == 0) {
+        snprintf(data, size, "%lu\n", devinfo->storage.total);
+    } else if (strcmp(name, "storage_free") == 0) {
+        snprintf(data, size, "%lu\n", devinfo->storage.free);
+    } else if (strcmp(name, "ram_total") == 0) {
+        snprintf(data, size, "%lu\n", devinfo->ram.total);
+    } else if (strcmp(name, "ram_free") == 0) {
+        snprintf(data, size, "%lu\n", devinfo->ram.free);
+    } else if (strcmp(name, "version_os_major") == 0) {
+        snprintf(data, size, "%d\n", devinfo->versions[NSPIRE_VER_OS].major);
+    } else if (strcmp(name, "version_os_minor") == 0) {
+        snprintf(data, size, "%d\n", devinfo->versions[NSPIRE_VER_OS].minor);
+    } else if (strcmp(name, "version_os_build") == 0) {
+        snprintf(data, size, "%d\n", devinfo->versions[NSPIRE_VER_OS].build);
+    } else if (strcmp(name, "version_os") == 0) {
         snprintf(
-            data, sizeof(data), "%d.%d.%d\n", devinfo.versions[NSPIRE_VER_OS].major,
-            devinfo.versions[NSPIRE_VER_OS].minor, devinfo.versions[NSPIRE_VER_OS].build
+            data, size, "%d.%d.%d\n", devinfo->versions[NSPIRE_VER_OS].major,
+            devinfo->versions[NSPIRE_VER_OS].minor, devinfo->versions[NSPIRE_VER_OS].build
         );
-    } else if (strcmp(path, "/.well-known/info/version_boot1_major") == 0) {
-        snprintf(data, sizeof(data), "%d\n", devinfo.versions[NSPIRE_VER_BOOT1].major);
-    } else if (strcmp(path, "/.well-known/info/version_boot1_minor") == 0) {
-        snprintf(data, sizeof(data), "%d\n", devinfo.versions[NSPIRE_VER_BOOT1].minor);
-    } else if (strcmp(path, "/.well-known/info/version_boot1_build") == 0) {
-        snprintf(data, sizeof(data), "%d\n", devinfo.versions[NSPIRE_VER_BOOT1].build);
-    } else if (strcmp(path, "/.well-known/info/version_boot1") == 0) {
+    } else if (strcmp(name, "version_boot1_major") == 0) {
+        snprintf(data, size, "%d\n", devinfo->versions[NSPIRE_VER_BOOT1].major);
+    } else if (strcmp(name, "version_boot1_minor") == 0) {
+        snprintf(data, size, "%d\n", devinfo->versions[NSPIRE_VER_BOOT1].minor);
+    } else if (strcmp(name, "version_boot1_build") == 0) {
+        snprintf(data, size, "%d\n", devinfo->versions[NSPIRE_VER_BOOT1].build);
+    } else if (strcmp(name, "version_boot1") == 0) {
         snprintf(
-            data, sizeof(data), "%d.%d.%d\n", devinfo.versions[NSPIRE_VER_BOOT1].major,
-            devinfo.versions[NSPIRE_VER_BOOT1].minor, devinfo.versions[NSPIRE_VER_BOOT1].build
+            data, size, "%d.%d.%d\n", devinfo->versions[NSPIRE_VER_BOOT1].major,
+            devinfo->versions[NSPIRE_VER_BOOT1].minor, devinfo->versions[NSPIRE_VER_BOOT1].build
         );
-    } else if (strcmp(path, "/.well-known/info/version_boot2_major") == 0) {
-        snprintf(data, sizeof(data), "%d\n", devinfo.versions[NSPIRE_VER_BOOT2].major);
-    } else if (strcmp(path, "/.well-known/info/version_boot2_minor") == 0) {
-        snprintf(data, sizeof(data), "%d\n", devinfo.versions[NSPIRE_VER_BOOT2].minor);
-    } else if (strcmp(path, "/.well-known/info/version_boot2_build") == 0) {
-        snprintf(data, sizeof(data), "%d\n", devinfo.versions[NSPIRE_VER_BOOT2].build);
-    } else if (strcmp(path, "/.well-known/info/version_boot2") == 0) {
+    } else if (strcmp(name, "version_boot2_major") == 0) {
+        snprintf(data, size, "%d\n", devinfo->versions[NSPIRE_VER_BOOT2].major);
+    } else if (strcmp(name, "version_boot2_minor") == 0) {
+        snprintf(data, size, "%d\n", devinfo->versions[NSPIRE_VER_BOOT2].minor);
+    } else if (strcmp(name, "version_boot2_build") == 0) {
+        snprintf(data, size, "%d\n", devinfo->versions[NSPIRE_VER_BOOT2].build);
+    } else if (strcmp(name, "version_boot2") == 0) {
         snprintf(
-            data, sizeof(data), "%d.%d.%d\n", devinfo.versions[NSPIRE_VER_BOOT2].major,
-            devinfo.versions[NSPIRE_VER_BOOT2].minor, devinfo.versions[NSPIRE_VER_BOOT2].build
+            data, size, "%d.%d.%d\n", devinfo->versions[NSPIRE_VER_BOOT2].major,
+            devinfo->versions[NSPIRE_VER_BOOT2].minor, devinfo->versions[NSPIRE_VER_BOOT2].build
         );
-    } else if (strcmp(path, "/.well-known/info/hw_type") == 0) {
-        if (devinfo.hw_type == NSPIRE_CAS) {
+    } else if (strcmp(name, "hw_type") == 0) {
+        if (devinfo->hw_type == NSPIRE_CAS) {
             strcpy(data, "cas");
-        } else if (devinfo.hw_type == NSPIRE_NONCAS) {
+        } else if (devinfo->hw_type == NSPIRE_NONCAS) {
             strcpy(data, "noncas");
-        } else if (devinfo.hw_type == NSPIRE_CASCX) {
+        } else if (devinfo->hw_type == NSPIRE_CASCX) {
             strcpy(data, "cascx");
-        } else if (devinfo.hw_type == NSPIRE_NONCASCX) {
+        } else if (devinfo->hw_type == NSPIRE_NONCASCX) {
             strcpy(data, "noncascx");
-        } else if (devinfo.hw_type == 0x1C) {
+        } else if (devinfo->hw_type == 0x1C) {
             strcpy(data, "cascx2");
-        } else if (devinfo.hw_type == 0x2C) {
+        } else if (devinfo->hw_type == 0x2C) {
             strcpy(data, "noncascx2");
         } else {
             strcpy(data, "unknown");
         }
-    } else if (strcmp(path, "/.well-known/info/batt_status") == 0) {
-        if (devinfo.batt.status == NSPIRE_BATT_POWERED) {
+    } else if (strcmp(name, "batt_status") == 0) {
+        if (devinfo->batt.status == NSPIRE_BATT_POWERED) {
             strcpy(data, "powered");
-        } else if (devinfo.batt.status == NSPIRE_BATT_LOW) {
+        } else if (devinfo->batt.status == NSPIRE_BATT_LOW) {
             strcpy(data, "low");
-        } else if (devinfo.batt.status == NSPIRE_BATT_OK) {
+        } else if (devinfo->batt.status == NSPIRE_BATT_OK) {
             strcpy(data, "ok");
         } else {
             strcpy(data, "unknown");
         }
-    } else if (strcmp(path, "/.well-known/info/batt_is_charging") == 0) {
-        snprintf(data, sizeof(data), "%u\n", devinfo.batt.is_charging);
-    } else if (strcmp(path, "/.well-known/info/clock_speed") == 0) {
-        snprintf(data, sizeof(data), "%u\n", devinfo.clock_speed);
-    } else if (strcmp(path, "/.well-known/info/lcd_width") == 0) {
-        snprintf(data, sizeof(data), "%u\n", devinfo.lcd.width);
-    } else if (strcmp(path, "/.well-known/info/lcd_height") == 0) {
-        snprintf(data, sizeof(data), "%u\n", devinfo.lcd.height);
-    } else if (strcmp(path, "/.well-known/info/lcd_bbp") == 0) {
-        snprintf(data, sizeof(data), "%u\n", devinfo.lcd.bbp);
-    } else if (strcmp(path, "/.well-known/info/lcd_sample_mode") == 0) {
-        snprintf(data, sizeof(data), "%u\n", devinfo.lcd.sample_mode);
-    } else if (strcmp(path, "/.well-known/info/extensions_file") == 0) {
-        strcpy(data, devinfo.extensions.file);
-    } else if (strcmp(path, "/.well-known/info/extensions_os") == 0) {
-        strcpy(data, devinfo.extensions.os);
-    } else if (strcmp(path, "/.well-known/info/device_name") == 0) {
-        strcpy(data, devinfo.device_name);
-    } else if (strcmp(path, "/.well-known/info/electronic_id") == 0) {
-        strcpy(data, devinfo.electronic_id);
-    } else if (strcmp(path, "/.well-known/info/runlevel") == 0) {
-        if (devinfo.runlevel == NSPIRE_RUNLEVEL_RECOVERY) {
+    } else if (strcmp(name, "batt_is_charging") == 0) {
+        snprintf(data, size, "%u\n", devinfo->batt.is_charging);
+    } else if (strcmp(name, "clock_speed") == 0) {
+        snprintf(data, size, "%u\n", devinfo->clock_speed);
+    } else if (strcmp(name, "lcd_width") == 0) {
+        snprintf(data, size, "%u\n", devinfo->lcd.width);
+    } else if (strcmp(name, "lcd_height") == 0) {
+        snprintf(data, size, "%u\n", devinfo->lcd.height);
+    } else if (strcmp(name, "lcd_bbp") == 0) {
+        snprintf(data, size, "%u\n", devinfo->lcd.bbp);
+    } else if (strcmp(name, "lcd_sample_mode") == 0) {
+        snprintf(data, size, "%u\n", devinfo->lcd.sample_mode);
+    } else if (strcmp(name, "extensions_file") == 0) {
+        strcpy(data, devinfo->extensions.file);
+    } else if (strcmp(name, "extensions_os") == 0) {
+        strcpy(data, devinfo->extensions.os);
+    } else if (strcmp(name, "device_name") == 0) {
+        strcpy(data, devinfo->device_name);
+    } else if (strcmp(name, "electronic_id") == 0) {
+        strcpy(data, devinfo->electronic_id);
+    } else if (strcmp(name, "runlevel") == 0) {
+        if (devinfo->runlevel == NSPIRE_RUNLEVEL_RECOVERY) {
             strcpy(data, "recovery");
-        } else if (devinfo.runlevel == NSPIRE_RUNLEVEL_OS) {
+        } else if (devinfo->runlevel == NSPIRE_RUNLEVEL_OS) {
             strcpy(data, "os");
         } else {
             strcpy(data, "unknown");
         }
+    } else if (strcmp(name, "connection") == 0) {
+        snprintf(data, size, "%s\n", connect_state_str(ctx->conn_state));
     } else {
         return -ENOENT;
     }
 
+    return 0;
+}
+
+int info_readdir(void *buf, fuse_fill_dir_t filler) {
+    filler(buf, ".", NULL, 0, 0);
+    filler(buf, "..", NULL, 0, 0);
+
+    for (size_t i = 0; i < sizeof(info_files) / sizeof(info_files[0]); i++) {
+        filler(buf, info_files[i], NULL, 0, 0);
+    }
+
+    return 0;
+}
+
+int info_getattr(const char *path, struct stat *stbuf) {
+    if (!info_lookup(path)) {
+        return -ENOENT;
+    }
+
+    stbuf->st_mode = S_IFREG | 0444;
+    stbuf->st_nlink = 1;
+    stbuf->st_size = INFO_DATA_SIZE;
+    stbuf->st_uid = getuid();
+    stbuf->st_gid = getgid();
+    return 0;
+}
+
+int info_open(const char *path, struct fuse_file_info *fi) {
+    nfuspire_ctx_t *ctx = current_nfuspire_ctx;
+    struct info_handle *handle;
+    const char *name;
+
+    name = info_lookup(path);
+    if (!name) {
+        return -ENOENT;
+    }
+
+    handle = calloc(1, sizeof(struct info_handle));
+    if (!handle) {
+        return -ENOMEM;
+    }
+
+    handle->name = name;
+
+    pthread_mutex_lock(&ctx->devinfo_mutex);
+    handle->next = ctx->info_handles;
+    ctx->info_handles = handle;
+    pthread_mutex_unlock(&ctx->devinfo_mutex);
+
+    // Contents change behind the kernel's back, never serve them from the page cache
+    fi->direct_io = 1;
+    fi->fh = (typeof(fi->fh))handle;
+    return 0;
+}
+
+int info_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+    nfuspire_ctx_t *ctx = current_nfuspire_ctx;
+    struct info_handle *handle = (struct info_handle *)(fi->fh);
+    const char *name;
+    char data[INFO_DATA_SIZE];
+    int rc;
+
+    name = info_lookup(path);
+    if (!name) {
+        return -ENOENT;
+    }
+
+    pthread_mutex_lock(&ctx->devinfo_mutex);
+
+    rc = info_render(name, ctx, data, sizeof(data));
+    if (!rc && handle) {
+        strcpy(handle->data, data);
+    }
+
+    pthread_mutex_unlock(&ctx->devinfo_mutex);
+
+    if (rc) {
+        return rc;
+    }
+
     size_t len = strlen(data);
 
     if (offset < 0 || (size_t)offset >= len)
@@ -190,3 +269,75 @@ int info_read(const char *path, char *buf, size_t size, off_t offset) {
     memcpy(buf, data + offset, size);
     return size;
 }
+
+int info_poll(struct fuse_file_info *fi, struct fuse_pollhandle *ph, unsigned *reventsp) {
+    nfuspire_ctx_t *ctx = current_nfuspire_ctx;
+    struct info_handle *handle = (struct info_handle *)(fi->fh);
+    char data[INFO_DATA_SIZE];
+
+    if (!handle) {
+        if (ph) {
+            fuse_pollhandle_destroy(ph);
+        }
+
+        return -EINVAL;
+    }
+
+    pthread_mutex_lock(&ctx->devinfo_mutex);
+
+    // Readable once the rendered value differs from what this handle last read
+    if (!info_render(handle->name, ctx, data, sizeof(data)) && strcmp(data, handle->data) != 0) {
+        *reventsp |= POLLIN;
+    }
+
+    if (ph) {
+        if (handle->ph) {
+            fuse_pollhandle_destroy(handle->ph);
+        }
+
+        handle->ph = ph;
+    }
+
+    pthread_mutex_unlock(&ctx->devinfo_mutex);
+    return 0;
+}
+
+int info_release(struct fuse_file_info *fi) {
+    nfuspire_ctx_t *ctx = current_nfuspire_ctx;
+    struct info_handle *handle = (struct info_handle *)(fi->fh);
+    struct info_handle **it;
+
+    if (!handle) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&ctx->devinfo_mutex);
+
+    for (it = &ctx->info_handles; *it; it = &(*it)->next) {
+        if (*it == handle) {
+            *it = handle->next;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&ctx->devinfo_mutex);
+
+    if (handle->ph) {
+        fuse_pollhandle_destroy(handle->ph);
+    }
+
+    free(handle);
+    fi->fh = 0;
+
+    return 0;
+}
+
+void info_notify(nfuspire_ctx_t *ctx) {
+    for (struct info_handle *handle = ctx->info_handles; handle; handle = handle->next) {
+        if (handle->ph) {
+            fuse_notify_poll(handle->ph);
+            fuse_pollhandle_destroy(handle->ph);
+            handle->ph = nullptr;
+        }
+    }
+}
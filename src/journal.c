@@ -0,0 +1,541 @@
+// SPDX-License-Identifier: GPL-3.0-only
+/*
+ *  nfuspire/src/journal.c
+ *
+ *  Copyright (C) Emily <info@emy.sh>
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <nfuspire/cache.h>
+#include <nfuspire/connect.h>
+#include <nfuspire/devinfo.h>
+#include <nfuspire/journal.h>
+#include <nfuspire/nspire.h>
+#include <nspire.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#define JOURNAL_ID_SIZE sizeof(((struct nspire_devinfo *)0)->electronic_id)
+
+typedef struct journal_replay {
+    nfuspire_ctx_t *ctx;
+    char **files;
+    size_t num;
+} journal_replay_t;
+
+static uint32_t journal_crc_table[256];
+static pthread_once_t journal_crc_once = PTHREAD_ONCE_INIT;
+
+static void journal_crc_init(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+
+        for (int bit = 0; bit < 8; bit++) {
+            crc = crc & 1 ? (crc >> 1) ^ 0xedb88320 : crc >> 1;
+        }
+
+        journal_crc_table[i] = crc;
+    }
+}
+
+static uint32_t journal_crc(uint32_t crc, const void *buf, size_t size) {
+    const unsigned char *it = buf;
+
+    pthread_once(&journal_crc_once, journal_crc_init);
+
+    crc = ~crc;
+    while (size--) {
+        crc = journal_crc_table[(crc ^ *it++) & 0xff] ^ (crc >> 8);
+    }
+
+    return ~crc;
+}
+
+static uint32_t journal_record_crc(const journal_record_t *record, const void *payload) {
+    journal_record_t header = *record;
+
+    header.crc = 0;
+    return journal_crc(journal_crc(0, &header, sizeof(header)), payload, record->len);
+}
+
+// The record and its payload go out in a single append, a torn one fails its checksum on replay
+static int journal_append(journal_t *journal, journal_type_t type, uint64_t offset, const void *payload, size_t len) {
+    journal_record_t record = {
+        .magic = JOURNAL_MAGIC,
+        .type = type,
+        .offset = offset,
+        .len = len,
+    };
+    struct iovec iov[2] = {
+        {.iov_base = &record, .iov_len = sizeof(record)},
+        {.iov_base = (void *)payload, .iov_len = len},
+    };
+    ssize_t written;
+
+    record.crc = journal_record_crc(&record, payload);
+
+    written = writev(journal->fd, iov, 2);
+    if (written < 0) {
+        return -errno;
+    }
+
+    return (size_t)written == sizeof(record) + len ? 0 : -EIO;
+}
+
+// cache->mutex must be held
+static int journal_open(nfuspire_ctx_t *ctx, nfuspire_file_cache_t *cache) {
+    struct nspire_devinfo devinfo;
+    unsigned char header[JOURNAL_ID_SIZE + PATH_MAX];
+    size_t path_len = strlen(cache->path) + 1;
+    journal_t *journal;
+    int rc;
+
+    if (cache->journal) {
+        return 0;
+    }
+
+    // Replays only go to the calculator the data was written for, a journal for no calculator is never replayed
+    devinfo_get(ctx, &devinfo);
+    if (!devinfo.electronic_id[0]) {
+        return -ENODEV;
+    }
+
+    journal = calloc(1, sizeof(journal_t));
+    if (!journal) {
+        return -ENOMEM;
+    }
+
+    journal->path = malloc(PATH_MAX);
+    if (!journal->path) {
+        free(journal);
+        return -ENOMEM;
+    }
+
+    snprintf(journal->path, PATH_MAX, "%s/XXXXXX" JOURNAL_SUFFIX, ctx->journal_dir);
+
+    journal->fd = mkstemps(journal->path, strlen(JOURNAL_SUFFIX));
+    if (journal->fd < 0) {
+        rc = -errno;
+        goto exit_free;
+    }
+
+    memcpy(header, devinfo.electronic_id, JOURNAL_ID_SIZE);
+    memcpy(header + JOURNAL_ID_SIZE, cache->path, path_len);
+
+    rc = journal_append(journal, JOURNAL_HEADER, 0, header, JOURNAL_ID_SIZE + path_len);
+    if (!rc) {
+        /*
+         * The whole content the changes start from, a crash in the middle
+         * of an upload leaves nothing usable on the device to replay on.
+         */
+        rc = journal_append(journal, JOURNAL_BASE, 0, cache->data, cache->size);
+    }
+
+    if (rc) {
+        unlink(journal->path);
+        close(journal->fd);
+        goto exit_free;
+    }
+
+    cache->journal = journal;
+    return 0;
+
+exit_free:
+    free(journal->path);
+    free(journal);
+    return rc;
+}
+
+// Journals are opened for the connected calculator, so this waits for it before cache->mutex is taken
+int journal_ready(nfuspire_ctx_t *ctx) {
+    if (!ctx->journal_dir) {
+        return 0;
+    }
+
+    return connect_wait(ctx);
+}
+
+// cache->mutex must be held
+int journal_write(nfuspire_ctx_t *ctx, nfuspire_file_cache_t *cache, const void *buf, size_t size, off_t offset) {
+    int rc;
+
+    if (!ctx->journal_dir || cache->unlinked) {
+        return 0;
+    }
+
+    rc = journal_open(ctx, cache);
+    if (rc) {
+        return rc;
+    }
+
+    return journal_append(cache->journal, JOURNAL_WRITE, offset, buf, size);
+}
+
+// cache->mutex must be held
+int journal_truncate(nfuspire_ctx_t *ctx, nfuspire_file_cache_t *cache, off_t size) {
+    int rc;
+
+    if (!ctx->journal_dir || cache->unlinked) {
+        return 0;
+    }
+
+    rc = journal_open(ctx, cache);
+    if (rc) {
+        return rc;
+    }
+
+    return journal_append(cache->journal, JOURNAL_TRUNCATE, size, nullptr, 0);
+}
+
+// cache->mutex must be held
+void journal_rename(nfuspire_file_cache_t *cache) {
+    if (!cache->journal) {
+        return;
+    }
+
+    if (journal_append(cache->journal, JOURNAL_RENAME, 0, cache->path, strlen(cache->path) + 1)) {
+        fprintf(stderr, "Unable to journal a rename to %s\n", cache->path);
+    }
+}
+
+// cache->mutex must be held, for data that is on the device or no longer wanted
+void journal_discard(nfuspire_file_cache_t *cache) {
+    if (!cache->journal) {
+        return;
+    }
+
+    unlink(cache->journal->path);
+    journal_close(cache);
+}
+
+// Keeps the journal around, whatever it holds is replayed on the next start
+void journal_close(nfuspire_file_cache_t *cache) {
+    if (!cache->journal) {
+        return;
+    }
+
+    close(cache->journal->fd);
+    free(cache->journal->path);
+    free(cache->journal);
+    cache->journal = nullptr;
+}
+
+static int journal_read(const char *file, unsigned char **buf, size_t *size) {
+    struct stat st;
+    ssize_t len;
+    int fd, rc = 0;
+
+    fd = open(file, O_RDONLY);
+    if (fd < 0) {
+        return -errno;
+    }
+
+    if (fstat(fd, &st) < 0) {
+        rc = -errno;
+        goto exit;
+    }
+
+    *buf = malloc(st.st_size ? st.st_size : 1);
+    if (!*buf) {
+        rc = -ENOMEM;
+        goto exit;
+    }
+
+    len = read(fd, *buf, st.st_size);
+    if (len < 0) {
+        rc = -errno;
+        free(*buf);
+        goto exit;
+    }
+
+    *size = len;
+
+exit:
+    close(fd);
+    return rc;
+}
+
+// Reads the record at *pos and moves past it, returns its payload or nullptr past the valid part
+static const unsigned char *journal_next(const unsigned char *buf, size_t size, size_t *pos, journal_record_t *record) {
+    const unsigned char *payload = buf + *pos + sizeof(*record);
+
+    // Records are packed back to back, so they are copied out rather than accessed in place
+    if (size - *pos < sizeof(*record)) {
+        return nullptr;
+    }
+
+    memcpy(record, buf + *pos, sizeof(*record));
+
+    if (record->magic != JOURNAL_MAGIC || record->len > size - *pos - sizeof(*record) ||
+        journal_record_crc(record, payload) != record->crc) {
+        return nullptr;
+    }
+
+    *pos += sizeof(*record) + record->len;
+    return payload;
+}
+
+static int journal_replay_file(nfuspire_ctx_t *ctx, const char *file, const struct nspire_devinfo *devinfo) {
+    unsigned char *buf, *data = nullptr, *new_data;
+    const unsigned char *payload;
+    journal_record_t record;
+    const char *id, *path;
+    struct nspire_dir_item item;
+    size_t size, pos = 0, data_size = 0, end;
+    uint64_t new_size;
+    int rc;
+
+    rc = journal_read(file, &buf, &size);
+    if (rc) {
+        return rc;
+    }
+
+    payload = journal_next(buf, size, &pos, &record);
+    if (!payload || record.type != JOURNAL_HEADER || record.len <= JOURNAL_ID_SIZE || buf[pos - 1] != '\0') {
+        // Crashed before the header made it out, nothing was journaled
+        unlink(file);
+        goto exit;
+    }
+
+    id = (const char *)payload;
+    path = id + JOURNAL_ID_SIZE;
+
+    // Written before the calculator was known, it could belong to any of them and is kept for the user
+    if (!id[0]) {
+        fprintf(stderr, "Not replaying %s, it doesn't name the calculator it belongs to\n", file);
+        rc = -ENODEV;
+        goto exit;
+    }
+
+    // Left alone until the calculator it belongs to is connected
+    if (strncmp(id, devinfo->electronic_id, JOURNAL_ID_SIZE) != 0) {
+        rc = -ENODEV;
+        goto exit;
+    }
+
+    // The file is uploaded under the name it ended up with
+    for (end = pos; (payload = journal_next(buf, size, &end, &record));) {
+        if (record.type == JOURNAL_RENAME && record.len && payload[record.len - 1] == '\0') {
+            path = (const char *)payload;
+        }
+    }
+
+    payload = journal_next(buf, end, &pos, &record);
+    if (!payload || record.type != JOURNAL_BASE) {
+        // Torn before the first write was accepted, the file never changed
+        unlink(file);
+        goto exit;
+    }
+
+    data = malloc(record.len ? record.len : 1);
+    if (!data) {
+        rc = -ENOMEM;
+        goto exit;
+    }
+
+    memcpy(data, payload, record.len);
+    data_size = record.len;
+
+    while ((payload = journal_next(buf, end, &pos, &record))) {
+        if (record.type != JOURNAL_WRITE && record.type != JOURNAL_TRUNCATE) {
+            continue;
+        }
+
+        new_size = record.offset + (record.type == JOURNAL_WRITE ? record.len : 0);
+
+        if (new_size > data_size || record.type == JOURNAL_TRUNCATE) {
+            new_data = realloc(data, new_size ? new_size : 1);
+            if (!new_data) {
+                rc = -ENOMEM;
+                goto exit;
+            }
+
+            if (new_size > data_size) {
+                memset(new_data + data_size, 0, new_size - data_size);
+            }
+
+            data = new_data;
+            data_size = new_size;
+        }
+
+        if (record.type == JOURNAL_WRITE) {
+            memcpy(data + record.offset, payload, record.len);
+        }
+    }
+
+    // Only needed to account for the storage, the content comes from the journal alone
+    rc = nfuspire_attr(ctx, path, &item);
+    if (rc == -ENOENT) {
+        item.size = 0;
+        rc = 0;
+    }
+
+    if (rc) {
+        goto exit;
+    }
+
+    rc = nfuspire_device_lock(ctx);
+    if (rc) {
+        goto exit;
+    }
+
+    rc = nfuspire_error(nspire_file_write(ctx->handle, path, data, data_size));
+
+    nfuspire_device_unlock(ctx);
+
+    if (rc) {
+        goto exit;
+    }
+
+    cache_invalidate(ctx, path);
+    devinfo_storage_used(ctx, (int64_t)data_size - (int64_t)item.size);
+    fprintf(stderr, "Recovered %s from the journal\n", path);
+
+    unlink(file);
+
+exit:
+    free(data);
+    free(buf);
+    return rc;
+}
+
+static void journal_replay_free(journal_replay_t *replay) {
+    for (size_t i = 0; i < replay->num; i++) {
+        free(replay->files[i]);
+    }
+
+    free(replay->files);
+    free(replay);
+}
+
+static void *journal_worker(void *arg) {
+    journal_replay_t *replay = arg;
+    nfuspire_ctx_t *ctx = replay->ctx;
+    struct nspire_devinfo devinfo;
+    int rc;
+
+    rc = connect_wait(ctx);
+    if (rc) {
+        fprintf(stderr, "No device to replay the journal to\n");
+        goto exit;
+    }
+
+    devinfo_get(ctx, &devinfo);
+
+    for (size_t i = 0; i < replay->num; i++) {
+        rc = journal_replay_file(ctx, replay->files[i], &devinfo);
+        if (rc && rc != -ENODEV) {
+            fprintf(stderr, "Unable to replay %s: %s\n", replay->files[i], strerror(-rc));
+        }
+    }
+
+exit:
+    journal_replay_free(replay);
+    return nullptr;
+}
+
+// Fuse changes into / when daemonizing, a relative directory has to be made absolute before that
+int journal_resolve(nfuspire_ctx_t *ctx) {
+    char *path;
+
+    if (!ctx->journal_dir) {
+        return 0;
+    }
+
+    if (mkdir(ctx->journal_dir, 0700) < 0 && errno != EEXIST) {
+        return -errno;
+    }
+
+    path = realpath(ctx->journal_dir, nullptr);
+    if (!path) {
+        return -errno;
+    }
+
+    free(ctx->journal_dir);
+    ctx->journal_dir = path;
+    return 0;
+}
+
+int journal_start(nfuspire_ctx_t *ctx) {
+    journal_replay_t *replay;
+    struct dirent *entry;
+    char **files;
+    size_t len;
+    DIR *dir;
+    int rc;
+
+    if (!ctx->journal_dir) {
+        return 0;
+    }
+
+    if (mkdir(ctx->journal_dir, 0700) < 0 && errno != EEXIST) {
+        return -errno;
+    }
+
+    replay = calloc(1, sizeof(journal_replay_t));
+    if (!replay) {
+        return -ENOMEM;
+    }
+
+    replay->ctx = ctx;
+
+    // Collected before any request comes in, so only journals of earlier runs are replayed
+    dir = opendir(ctx->journal_dir);
+    if (!dir) {
+        free(replay);
+        return -errno;
+    }
+
+    while ((entry = readdir(dir))) {
+        len = strlen(entry->d_name);
+        if (len <= strlen(JOURNAL_SUFFIX) || strcmp(entry->d_name + len - strlen(JOURNAL_SUFFIX), JOURNAL_SUFFIX)) {
+            continue;
+        }
+
+        files = realloc(replay->files, (replay->num + 1) * sizeof(char *));
+        if (!files) {
+            break;
+        }
+
+        replay->files = files;
+        replay->files[replay->num] = malloc(PATH_MAX);
+        if (!replay->files[replay->num]) {
+            break;
+        }
+
+        snprintf(replay->files[replay->num++], PATH_MAX, "%s/%s", ctx->journal_dir, entry->d_name);
+    }
+
+    closedir(dir);
+
+    if (!replay->num) {
+        journal_replay_free(replay);
+        return 0;
+    }
+
+    rc = pthread_create(&ctx->journal_thread, NULL, journal_worker, replay);
+    if (rc) {
+        journal_replay_free(replay);
+        return -rc;
+    }
+
+    ctx->journal_running = true;
+    return 0;
+}
+
+void journal_stop(nfuspire_ctx_t *ctx) {
+    if (!ctx->journal_running) {
+        return;
+    }
+
+    pthread_join(ctx->journal_thread, NULL);
+    ctx->journal_running = false;
+}
@@ -7,17 +7,122 @@
 
 #include <errno.h>
 #include <fuse.h>
+#include <nfuspire/backup.h>
+#include <nfuspire/cache.h>
+#include <nfuspire/connect.h>
+#include <nfuspire/control.h>
+#include <nfuspire/devinfo.h>
+#include <nfuspire/import.h>
+#include <nfuspire/index.h>
 #include <nfuspire/info.h>
+#include <nfuspire/journal.h>
 #include <nfuspire/nspire.h>
+#include <nfuspire/prefetch.h>
+#include <nfuspire/stats.h>
 #include <nfuspire/update.h>
+#include <nfuspire/writeback.h>
 #include <nspire.h>
+#include <poll.h>
 #include <pthread.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #define STARTS_WITH(str, prefix) (strncmp((str), (prefix), strlen((prefix))) == 0)
 
+#define IO_URING_PARAM "/sys/module/fuse/parameters/enable_uring"
+
+#define NFUSPIRE_OPT(templ, member) {templ, offsetof(nfuspire_ctx_t, member), 1}
+
+static const struct fuse_opt nfuspire_opts[] = {
+    NFUSPIRE_OPT("devinfo_refresh=%u", devinfo_interval),
+    NFUSPIRE_OPT("upload_delay=%u", upload_delay),
+    NFUSPIRE_OPT("async_connect", async_connect),
+    NFUSPIRE_OPT("connect_timeout=%u", conn_timeout),
+    NFUSPIRE_OPT("cache_ttl=%u", cache_ttl),
+    NFUSPIRE_OPT("cache_size=%lu", cache_maxsize),
+    NFUSPIRE_OPT("io_uring", io_uring),
+    NFUSPIRE_OPT("prefetch_size=%lu", prefetch_size),
+    NFUSPIRE_OPT("journal=%s", journal_dir),
+    NFUSPIRE_OPT("index_ttl=%u", index_ttl),
+    FUSE_OPT_END,
+};
+
+/*
+ * FUSE over io_uring needs libfuse 3.18 and a kernel that has it
+ * enabled, older libfuse versions refuse to mount with the option.
+ */
+static bool io_uring_available(void) {
+    char enabled = 'N';
+    FILE *param;
+
+    if (fuse_version() < 318) {
+        return false;
+    }
+
+    param = fopen(IO_URING_PARAM, "r");
+    if (!param) {
+        return false;
+    }
+
+    if (fread(&enabled, 1, 1, param) != 1) {
+        enabled = 'N';
+    }
+
+    fclose(param);
+    return enabled == 'Y';
+}
+
+static void *fuse_ctx_init(__attribute__((unused)) struct fuse_conn_info *conn, struct fuse_config *cfg) {
+    nfuspire_ctx_t *ctx = current_nfuspire_ctx;
+
+    // Lets long waits for the device notice a Ctrl-C through fuse_interrupted()
+    cfg->intr = 1;
+
+#ifdef FUSE_CAP_OVER_IO_URING
+    // The kernel has the last word, libfuse keeps using /dev/fuse without it
+    if (ctx->io_uring && !fuse_get_feature_flag(conn, FUSE_CAP_OVER_IO_URING)) {
+        fprintf(stderr, "The kernel declined FUSE over io_uring, using /dev/fuse\n");
+    }
+#endif
+
+    // Threads don't survive daemonizing, start them once fuse is up
+    if (connect_start(ctx)) {
+        fprintf(stderr, "Unable to connect in the background\n");
+    }
+
+    if (journal_start(ctx)) {
+        fprintf(stderr, "Unable to replay the journal\n");
+    }
+
+    if (devinfo_start(ctx)) {
+        fprintf(stderr, "Unable to start the device info refresh\n");
+    }
+
+    if (writeback_start(ctx)) {
+        fprintf(stderr, "Unable to start the writeback, uploading on close\n");
+    }
+
+    if (prefetch_start(ctx)) {
+        fprintf(stderr, "Unable to start prefetching\n");
+    }
+
+    return ctx;
+}
+
+static void fuse_ctx_destroy(void *private_data) {
+    nfuspire_ctx_t *ctx = private_data;
+
+    import_stop(ctx);
+    journal_stop(ctx);
+    prefetch_stop(ctx);
+    writeback_stop(ctx);
+    devinfo_stop(ctx);
+    connect_stop(ctx);
+}
+
 static int fuse_readdir(
     const char *path, void *buf, fuse_fill_dir_t filler, __attribute__((unused)) off_t offset,
     __attribute__((unused)) struct fuse_file_info *fi, __attribute__((unused)) enum fuse_readdir_flags flags
@@ -29,6 +134,13 @@ static int fuse_readdir(
         filler(buf, "..", NULL, 0, 0);
         filler(buf, "info", NULL, 0, 0);
         filler(buf, "os_update", NULL, 0, 0);
+        filler(buf, "control", NULL, 0, 0);
+        filler(buf, "stats", NULL, 0, 0);
+        filler(buf, "backup.tar", NULL, 0, 0);
+        filler(buf, "import", NULL, 0, 0);
+        filler(buf, "import_status", NULL, 0, 0);
+        filler(buf, "index", NULL, 0, 0);
+        filler(buf, "index.bin", NULL, 0, 0);
         return 0;
     } else if (strcmp(path, "/.well-known/info") == 0) {
         return info_readdir(buf, filler);
@@ -48,7 +160,7 @@ static int fuse_getattr(const char *path, struct stat *stbuf, __attribute__((unu
         return 0;
     }
 
-    if (strcmp(path, "/.well-known/os_update") == 0) {
+    if (strcmp(path, "/.well-known/os_update") == 0 || strcmp(path, IMPORT_PATH) == 0) {
         stbuf->st_mode = S_IFREG | 0222;
         stbuf->st_nlink = 1;
         stbuf->st_size = 0;
@@ -57,7 +169,43 @@ static int fuse_getattr(const char *path, struct stat *stbuf, __attribute__((unu
         return 0;
     }
 
-    if (STARTS_WITH(path, "/.well-known/info/")) {
+    if (strcmp(path, CONTROL_PATH) == 0) {
+        stbuf->st_mode = S_IFREG | 0666;
+        stbuf->st_nlink = 1;
+        stbuf->st_size = CONTROL_DATA_SIZE;
+        stbuf->st_uid = getuid();
+        stbuf->st_gid = getgid();
+        return 0;
+    }
+
+    if (strcmp(path, STATS_PATH) == 0) {
+        stbuf->st_mode = S_IFREG | 0444;
+        stbuf->st_nlink = 1;
+        stbuf->st_size = STATS_DATA_SIZE;
+        stbuf->st_uid = getuid();
+        stbuf->st_gid = getgid();
+        return 0;
+    }
+
+    if (strcmp(path, IMPORT_STATUS_PATH) == 0) {
+        stbuf->st_mode = S_IFREG | 0444;
+        stbuf->st_nlink = 1;
+        stbuf->st_size = IMPORT_STATUS_SIZE;
+        stbuf->st_uid = getuid();
+        stbuf->st_gid = getgid();
+        return 0;
+    }
+
+    if (strcmp(path, BACKUP_PATH) == 0 || strcmp(path, INDEX_PATH) == 0 || strcmp(path, INDEX_BIN_PATH) == 0) {
+        stbuf->st_mode = S_IFREG | 0444;
+        stbuf->st_nlink = 1;
+        stbuf->st_size = 0;
+        stbuf->st_uid = getuid();
+        stbuf->st_gid = getgid();
+        return 0;
+    }
+
+    if (STARTS_WITH(path, INFO_PATH_PREFIX)) {
         return info_getattr(path, stbuf);
     }
 
@@ -97,8 +245,9 @@ static int fuse_unlink(const char *path) {
 }
 
 static int fuse_statfs(__attribute__((unused)) const char *path, struct statvfs *info) {
-    struct nspire_devinfo devinfo = current_nfuspire_ctx->devinfo;
+    struct nspire_devinfo devinfo;
 
+    devinfo_get(current_nfuspire_ctx, &devinfo);
     memset(info, 0, sizeof(*info));
 
     info->f_bsize = info->f_frsize = 1 * 1024;
@@ -123,6 +272,36 @@ int fuse_open(const char *path, struct fuse_file_info *fi) {
         return update_open(fi);
     }
 
+    if (strcmp(path, CONTROL_PATH) == 0) {
+        return control_open(fi);
+    }
+
+    if (strcmp(path, STATS_PATH) == 0) {
+        fi->direct_io = 1;
+        return 0;
+    }
+
+    if (strcmp(path, BACKUP_PATH) == 0) {
+        return backup_open(fi);
+    }
+
+    if (strcmp(path, IMPORT_PATH) == 0) {
+        return import_open(fi);
+    }
+
+    if (strcmp(path, IMPORT_STATUS_PATH) == 0) {
+        fi->direct_io = 1;
+        return 0;
+    }
+
+    if (strcmp(path, INDEX_PATH) == 0 || strcmp(path, INDEX_BIN_PATH) == 0) {
+        return index_open(fi);
+    }
+
+    if (STARTS_WITH(path, INFO_PATH_PREFIX)) {
+        return info_open(path, fi);
+    }
+
     if (STARTS_WITH(path, "/.well-known")) {
         return 0;
     }
@@ -135,8 +314,28 @@ static int fuse_read(const char *path, char *buf, size_t size, off_t offset, str
         return -EINVAL;
     }
 
-    if (STARTS_WITH(path, "/.well-known/info/")) {
-        return info_read(path, buf, size, offset);
+    if (strcmp(path, CONTROL_PATH) == 0) {
+        return control_read(buf, size, offset);
+    }
+
+    if (strcmp(path, STATS_PATH) == 0) {
+        return stats_read(&current_nfuspire_ctx->stats, buf, size, offset);
+    }
+
+    if (strcmp(path, BACKUP_PATH) == 0) {
+        return backup_read(buf, size, offset, fi);
+    }
+
+    if (strcmp(path, IMPORT_STATUS_PATH) == 0) {
+        return import_status_read(buf, size, offset);
+    }
+
+    if (strcmp(path, INDEX_PATH) == 0 || strcmp(path, INDEX_BIN_PATH) == 0) {
+        return index_read(path, buf, size, offset, fi);
+    }
+
+    if (STARTS_WITH(path, INFO_PATH_PREFIX)) {
+        return info_read(path, buf, size, offset, fi);
     }
 
     return nfuspire_read(buf, size, offset, fi);
@@ -147,6 +346,14 @@ static int fuse_write(const char *path, const char *buf, size_t size, off_t offs
         return update_write(buf, size, offset, fi);
     }
 
+    if (strcmp(path, CONTROL_PATH) == 0) {
+        return control_write(buf, size);
+    }
+
+    if (strcmp(path, IMPORT_PATH) == 0) {
+        return import_write(buf, size, offset, fi);
+    }
+
     if (STARTS_WITH(path, "/.well-known")) {
         return -EINVAL;
     }
@@ -154,16 +361,32 @@ static int fuse_write(const char *path, const char *buf, size_t size, off_t offs
     return nfuspire_write(buf, size, offset, fi);
 }
 
+static ssize_t fuse_copy_file_range(
+    const char *path_in, struct fuse_file_info *fi_in, off_t offset_in, const char *path_out,
+    struct fuse_file_info *fi_out, off_t offset_out, size_t size, __attribute__((unused)) int flags
+) {
+    // Virtual files have no buffer to copy from, the kernel falls back to reading and writing
+    if (STARTS_WITH(path_in, "/.well-known") || STARTS_WITH(path_out, "/.well-known")) {
+        return -EOPNOTSUPP;
+    }
+
+    return nfuspire_copy_file_range(fi_in, offset_in, fi_out, offset_out, size);
+}
+
 static int fuse_fsync(const char *path, __attribute__((unused)) int isdatasync, struct fuse_file_info *fi) {
     if (strcmp(path, "/.well-known/os_update") == 0) {
         return update_fsync(fi);
     }
 
+    if (strcmp(path, CONTROL_PATH) == 0 || strcmp(path, IMPORT_PATH) == 0) {
+        return 0;
+    }
+
     if (STARTS_WITH(path, "/.well-known")) {
         return -EINVAL;
     }
 
-    return nfuspire_fsync(path, fi);
+    return nfuspire_fsync(fi);
 }
 
 static int fuse_release(const char *path, struct fuse_file_info *fi) {
@@ -171,14 +394,35 @@ static int fuse_release(const char *path, struct fuse_file_info *fi) {
         return update_release(fi);
     }
 
+    if (strcmp(path, BACKUP_PATH) == 0) {
+        return backup_release(fi);
+    }
+
+    if (strcmp(path, IMPORT_PATH) == 0) {
+        return import_release(fi);
+    }
+
+    if (strcmp(path, INDEX_PATH) == 0 || strcmp(path, INDEX_BIN_PATH) == 0) {
+        return index_release(fi);
+    }
+
+    if (STARTS_WITH(path, INFO_PATH_PREFIX)) {
+        return info_release(fi);
+    }
+
     if (STARTS_WITH(path, "/.well-known")) {
         return 0;
     }
 
-    return nfuspire_release(path, fi);
+    return nfuspire_release(fi);
 }
 
 static int fuse_truncate(const char *path, off_t size, __attribute__((unused)) struct fuse_file_info *fi) {
+    // Lets shell redirections open the control and import files
+    if (strcmp(path, CONTROL_PATH) == 0 || strcmp(path, IMPORT_PATH) == 0) {
+        return 0;
+    }
+
     if (STARTS_WITH(path, "/.well-known")) {
         return -EINVAL;
     }
@@ -186,6 +430,20 @@ static int fuse_truncate(const char *path, off_t size, __attribute__((unused)) s
     return nfuspire_truncate(path, size);
 }
 
+static int fuse_poll(const char *path, struct fuse_file_info *fi, struct fuse_pollhandle *ph, unsigned *reventsp) {
+    if (STARTS_WITH(path, INFO_PATH_PREFIX)) {
+        return info_poll(fi, ph, reventsp);
+    }
+
+    // Everything else is backed by a local buffer and always ready
+    if (ph) {
+        fuse_pollhandle_destroy(ph);
+    }
+
+    *reventsp |= POLLIN | POLLOUT;
+    return 0;
+}
+
 static int fuse_utimens(
     __attribute__((unused)) const char *path, __attribute__((unused)) const struct timespec tv[2],
     __attribute__((unused)) struct fuse_file_info *fi
@@ -206,38 +464,99 @@ static struct fuse_operations fuse_oper = {
     .read = fuse_read,
     .write = fuse_write,
     .fsync = fuse_fsync,
+    .copy_file_range = fuse_copy_file_range,
     .release = fuse_release,
     .truncate = fuse_truncate,
     .utimens = fuse_utimens,
+    .poll = fuse_poll,
+    .init = fuse_ctx_init,
+    .destroy = fuse_ctx_destroy,
 };
 
 int main(int argc, char *argv[]) {
     int rc;
     nfuspire_ctx_t *ctx;
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    pthread_condattr_t condattr;
 
-    ctx = malloc(sizeof(nfuspire_ctx_t));
+    ctx = calloc(1, sizeof(nfuspire_ctx_t));
     if (!ctx) {
         perror("Out of memory");
         return -ENOMEM;
     }
 
-    rc = nspire_init(&(ctx->handle));
-    if (rc != NSPIRE_ERR_SUCCESS) {
-        perror(nspire_strerror(rc));
-        return -1;
+    ctx->devinfo_interval = DEVINFO_DEFAULT_INTERVAL;
+    ctx->upload_delay = WRITEBACK_DEFAULT_DELAY;
+    ctx->conn_timeout = CONNECT_DEFAULT_TIMEOUT;
+    ctx->cache_ttl = CACHE_DEFAULT_TTL;
+    ctx->cache_maxsize = CACHE_DEFAULT_MAXSIZE;
+    ctx->index_ttl = INDEX_DEFAULT_TTL;
+
+    if (fuse_opt_parse(&args, ctx, nfuspire_opts, NULL) == -1) {
+        return -EINVAL;
+    }
+
+    // Requests are then served from per-CPU queues instead of reads and writes on /dev/fuse
+    if (ctx->io_uring) {
+        if (io_uring_available()) {
+            fuse_opt_add_arg(&args, "-oio_uring");
+        } else {
+            fprintf(stderr, "FUSE over io_uring isn't available, using /dev/fuse\n");
+            ctx->io_uring = false;
+        }
     }
 
-    rc = nspire_device_info(ctx->handle, &(ctx->devinfo));
-    if (rc != NSPIRE_ERR_SUCCESS) {
-        perror(nspire_strerror(rc));
-        return nfuspire_error(rc);
+    rc = journal_resolve(ctx);
+    if (rc) {
+        fprintf(stderr, "Unable to use the journal directory %s: %s\n", ctx->journal_dir, strerror(-rc));
+        return rc;
     }
 
     pthread_mutex_init(&ctx->mutex, NULL);
+    stats_init(&ctx->stats);
+    pthread_mutex_init(&ctx->files_mutex, NULL);
+    pthread_mutex_init(&ctx->flights_mutex, NULL);
+    pthread_mutex_init(&ctx->index_build_mutex, NULL);
+    pthread_mutex_init(&ctx->index_mutex, NULL);
+    pthread_mutex_init(&ctx->prefetch_mutex, NULL);
+    pthread_cond_init(&ctx->prefetch_cond, NULL);
+    pthread_mutex_init(&ctx->devinfo_mutex, NULL);
+    pthread_cond_init(&ctx->conn_cond, NULL);
+    pthread_mutex_init(&ctx->import_mutex, NULL);
+
+    rc = cache_init(ctx);
+    if (rc) {
+        perror("Out of memory");
+        return rc;
+    }
+
+    pthread_condattr_init(&condattr);
+    pthread_condattr_setclock(&condattr, CLOCK_MONOTONIC);
+    pthread_cond_init(&ctx->devinfo_cond, &condattr);
+    pthread_cond_init(&ctx->writeback_cond, &condattr);
+    pthread_condattr_destroy(&condattr);
+
+    // Otherwise the device is connected in the background once mounted
+    if (!ctx->async_connect) {
+        rc = connect_device(ctx);
+        if (rc != NSPIRE_ERR_SUCCESS) {
+            perror(nspire_strerror(rc));
+            return nfuspire_error(rc);
+        }
+    }
+
+    rc = fuse_main(args.argc, args.argv, &fuse_oper, ctx);
+
+    fuse_opt_free_args(&args);
+
+    if (ctx->handle) {
+        nspire_free(ctx->handle);
+    }
 
-    rc = fuse_main(argc, argv, &fuse_oper, ctx);
+    index_free(ctx);
+    cache_free(ctx);
 
-    nspire_free(ctx->handle);
+    free(ctx->journal_dir);
     free(ctx);
 
     return rc;
@@ -6,9 +6,20 @@
  */
 
 #include <errno.h>
+#include <limits.h>
+#include <nfuspire/cache.h>
+#include <nfuspire/connect.h>
+#include <nfuspire/devinfo.h>
+#include <nfuspire/flight.h>
+#include <nfuspire/journal.h>
 #include <nfuspire/nspire.h>
+#include <nfuspire/prefetch.h>
+#include <nfuspire/writeback.h>
 #include <nspire.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 int nfuspire_error(int error) {
@@ -42,18 +53,328 @@ int nfuspire_error(int error) {
     }
 }
 
-int nfuspire_readdir(const char *path, void *buf, fuse_fill_dir_t filler) {
+// ctx->files_mutex must be held
+static nfuspire_file_cache_t *file_cache_find(nfuspire_ctx_t *ctx, const char *path) {
+    for (nfuspire_file_cache_t *cache = ctx->files; cache; cache = cache->next) {
+        if (strcmp(cache->path, path) == 0) {
+            return cache;
+        }
+    }
+
+    return nullptr;
+}
+
+// ctx->files_mutex must be held
+static void file_cache_unlink(nfuspire_ctx_t *ctx, nfuspire_file_cache_t *cache) {
+    for (nfuspire_file_cache_t **it = &ctx->files; *it; it = &(*it)->next) {
+        if (*it == cache) {
+            *it = cache->next;
+            break;
+        }
+    }
+
+    cache->unlinked = true;
+}
+
+static nfuspire_file_cache_t *file_cache_get(nfuspire_ctx_t *ctx, const char *path) {
+    nfuspire_file_cache_t *cache;
+
+    pthread_mutex_lock(&ctx->files_mutex);
+
+    cache = file_cache_find(ctx, path);
+    if (cache) {
+        cache->refs++;
+    }
+
+    pthread_mutex_unlock(&ctx->files_mutex);
+    return cache;
+}
+
+static void file_cache_free(nfuspire_file_cache_t *cache) {
+    journal_close(cache);
+
+    if (cache->data) {
+        free(cache->data);
+    }
+
+    if (cache->path) {
+        free(cache->path);
+    }
+
+    free(cache);
+}
+
+/*
+ * ctx->files_mutex must be held, for files that are gone and whose
+ * writes can be forgotten. Returns whether the device has a copy, or
+ * gets one from an upload that is already running.
+ */
+static bool file_cache_remove(nfuspire_ctx_t *ctx, nfuspire_file_cache_t *cache) {
+    bool on_device;
+
+    file_cache_unlink(ctx, cache);
+
+    pthread_mutex_lock(&cache->mutex);
+    journal_discard(cache);
+    on_device = cache->on_device || cache->uploading;
+    pthread_mutex_unlock(&cache->mutex);
+
+    // The writeback thread only looks at listed files, so the reference it holds goes now
+    if (cache->pending) {
+        cache->pending = false;
+
+        if (!--cache->refs) {
+            file_cache_free(cache);
+        }
+    }
+
+    return on_device;
+}
+
+void nfuspire_file_put(nfuspire_ctx_t *ctx, nfuspire_file_cache_t *cache) {
+    bool last;
+
+    pthread_mutex_lock(&ctx->files_mutex);
+
+    last = --cache->refs == 0;
+    if (last && !cache->unlinked) {
+        file_cache_unlink(ctx, cache);
+    }
+
+    pthread_mutex_unlock(&ctx->files_mutex);
+
+    if (last) {
+        file_cache_free(cache);
+    }
+}
+
+// Returns the name of path if it is a direct child of dir
+static const char *path_child(const char *dir, const char *path) {
+    const char *name = strrchr(path, '/');
+    size_t len;
+
+    if (!name) {
+        return nullptr;
+    }
+
+    len = name - path;
+    if (strcmp(dir, "/") == 0) {
+        return len == 0 ? name + 1 : nullptr;
+    }
+
+    if (len != strlen(dir) || strncmp(dir, path, len) != 0) {
+        return nullptr;
+    }
+
+    return name + 1;
+}
+
+int nfuspire_attr(nfuspire_ctx_t *ctx, const char *path, struct nspire_dir_item *item) {
     int rc;
-    struct nspire_dir_info *list;
+    flight_t *flight;
+    void *shared;
+    size_t shared_size;
+    uint64_t generation;
+
+    if (cache_get_attr(ctx, path, item)) {
+        return 0;
+    }
 
-    pthread_mutex_lock(&current_nfuspire_ctx->mutex);
+    // Taken before asking the device, anything invalidated after that may be newer than the answer
+    generation = cache_generation(ctx);
+
+    rc = flight_join(ctx, FLIGHT_ATTR, path, 0, 0, generation, &flight, &shared, &shared_size);
+    if (rc) {
+        return rc;
+    }
+
+    if (!flight) {
+        memcpy(item, shared, sizeof(*item));
+        free(shared);
+        return 0;
+    }
+
+    rc = nfuspire_device_lock(ctx);
+    if (rc) {
+        goto exit;
+    }
+
+    rc = nfuspire_error(nspire_attr(ctx->handle, path, item));
+
+    nfuspire_device_unlock(ctx);
+
+    if (!rc) {
+        cache_put_attr(ctx, path, item, generation);
+    }
+
+exit:
+    flight_land(ctx, flight, rc, item, sizeof(*item));
+    return rc;
+}
+
+int nfuspire_dirlist(nfuspire_ctx_t *ctx, const char *path, struct nspire_dir_info **list) {
+    int rc;
+    flight_t *flight;
+    size_t shared_size;
+    struct nspire_dir_info *device_list;
+    uint64_t generation;
+
+    if (cache_get_list(ctx, path, list)) {
+        return 0;
+    }
+
+    generation = cache_generation(ctx);
+
+    rc = flight_join(ctx, FLIGHT_DIRLIST, path, 0, 0, generation, &flight, (void **)list, &shared_size);
+    if (rc || !flight) {
+        return rc;
+    }
+
+    *list = nullptr;
+
+    rc = nfuspire_device_lock(ctx);
+    if (rc) {
+        goto exit;
+    }
+
+    rc = nspire_dirlist(ctx->handle, path, &device_list);
+
+    nfuspire_device_unlock(ctx);
 
-    rc = nspire_dirlist(current_nfuspire_ctx->handle, path, &list);
     if (rc) {
         rc = nfuspire_error(rc);
         goto exit;
     }
 
+    *list = malloc(DIR_INFO_SIZE(device_list->num));
+    if (!*list) {
+        nspire_dirlist_free(device_list);
+        rc = -ENOMEM;
+        goto exit;
+    }
+
+    memcpy(*list, device_list, DIR_INFO_SIZE(device_list->num));
+    nspire_dirlist_free(device_list);
+
+    cache_put_list(ctx, path, *list, generation);
+
+exit:
+    flight_land(ctx, flight, rc, *list, *list ? DIR_INFO_SIZE((*list)->num) : 0);
+    return rc;
+}
+
+void nfuspire_path_join(char *buf, size_t size, const char *dir, const char *name) {
+    snprintf(buf, size, "%s/%s", strcmp(dir, "/") == 0 ? "" : dir, name);
+}
+
+// Visits everything below path, every directory before what it contains
+int nfuspire_walk(nfuspire_ctx_t *ctx, const char *path, nfuspire_walk_fn fn, void *arg) {
+    struct nspire_dir_info *list;
+    char child[PATH_MAX];
+    int rc;
+
+    rc = nfuspire_dirlist(ctx, path, &list);
+    if (rc) {
+        // Directories vanishing under us are skipped, losing the device is not
+        return rc == -ENOENT ? 0 : rc;
+    }
+
+    for (uint64_t i = 0; i < list->num && !rc; i++) {
+        const struct nspire_dir_item *item = &list->items[i];
+
+        nfuspire_path_join(child, sizeof(child), path, item->name);
+
+        rc = fn(ctx, child, item, arg);
+        if (!rc && item->type == NSPIRE_DIR) {
+            rc = nfuspire_walk(ctx, child, fn, arg);
+        }
+    }
+
+    free(list);
+    return rc;
+}
+
+int nfuspire_file_download(
+    nfuspire_ctx_t *ctx, const char *path, const struct nspire_dir_item *item, unsigned char **data, size_t *size
+) {
+    int rc;
+    flight_t *flight;
+
+    // Concurrent reads of the same version of a file share one transfer
+    rc = flight_join(
+        ctx, FLIGHT_READ, path, item->size, item->date, cache_generation(ctx), &flight, (void **)data, size
+    );
+    if (rc || !flight) {
+        return rc;
+    }
+
+    *data = malloc(item->size);
+    if (!*data) {
+        rc = -ENOMEM;
+        goto exit;
+    }
+
+    *size = item->size;
+
+    if (item->size) {
+        rc = nfuspire_device_lock(ctx);
+        if (!rc) {
+            rc = nfuspire_error(nspire_file_read(ctx->handle, path, *data, item->size, size));
+            nfuspire_device_unlock(ctx);
+        }
+    }
+
+    if (rc) {
+        free(*data);
+        *data = nullptr;
+    }
+
+exit:
+    flight_land(ctx, flight, rc, *data, rc ? 0 : *size);
+    return rc;
+}
+
+int nfuspire_file_fetch(
+    nfuspire_ctx_t *ctx, const char *path, const struct nspire_dir_item *item, unsigned char **data, size_t *size
+) {
+    int rc;
+
+    if (cache_get_data(ctx, path, item, data)) {
+        *size = item->size;
+        return 0;
+    }
+
+    rc = nfuspire_file_download(ctx, path, item, data, size);
+    if (rc) {
+        return rc;
+    }
+
+    if (*size == item->size) {
+        cache_put_data(ctx, path, item, *data, false);
+    }
+
+    return 0;
+}
+
+static bool dir_list_has(const struct nspire_dir_info *list, const char *name) {
+    for (uint64_t i = 0; i < list->num; i++) {
+        if (strcmp(list->items[i].name, name) == 0) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+int nfuspire_readdir(const char *path, void *buf, fuse_fill_dir_t filler) {
+    int rc;
+    struct nspire_dir_info *list;
+
+    rc = nfuspire_dirlist(current_nfuspire_ctx, path, &list);
+    if (rc) {
+        return rc;
+    }
+
     filler(buf, ".", NULL, 0, 0);
     filler(buf, "..", NULL, 0, 0);
 
@@ -61,24 +382,56 @@ int nfuspire_readdir(const char *path, void *buf, fuse_fill_dir_t filler) {
         filler(buf, list->items[i].name, NULL, 0, 0);
     }
 
-    nspire_dirlist_free(list);
-    rc = 0;
+    // Something in here is likely to be opened next
+    prefetch_dir(current_nfuspire_ctx, path, list);
 
-exit:
-    pthread_mutex_unlock(&current_nfuspire_ctx->mutex);
-    return rc;
+    // Files created on this mount that haven't been uploaded yet, unless they replace one on the device
+    pthread_mutex_lock(&current_nfuspire_ctx->files_mutex);
+
+    for (nfuspire_file_cache_t *cache = current_nfuspire_ctx->files; cache; cache = cache->next) {
+        const char *name = path_child(path, cache->path);
+
+        if (name && !cache->on_device && !dir_list_has(list, name)) {
+            filler(buf, name, NULL, 0, 0);
+        }
+    }
+
+    pthread_mutex_unlock(&current_nfuspire_ctx->files_mutex);
+
+    free(list);
+    return 0;
 }
 
 int nfuspire_getattr(const char *path, struct stat *stbuf) {
     int rc;
+    nfuspire_file_cache_t *cache;
     struct nspire_dir_item item;
 
-    pthread_mutex_lock(&current_nfuspire_ctx->mutex);
+    // Dirty buffers are newer than what the device knows about
+    pthread_mutex_lock(&current_nfuspire_ctx->files_mutex);
 
-    rc = nspire_attr(current_nfuspire_ctx->handle, path, &item);
+    cache = file_cache_find(current_nfuspire_ctx, path);
+    if (cache && (!cache->on_device || cache->need_sync)) {
+        pthread_mutex_lock(&cache->mutex);
+
+        stbuf->st_size = cache->size;
+        stbuf->st_nlink = 1;
+        stbuf->st_mode = S_IFREG | 0755;
+        stbuf->st_mtime = stbuf->st_atime = stbuf->st_ctime = cache->mtime;
+
+        stbuf->st_uid = getuid();
+        stbuf->st_gid = getgid();
+
+        pthread_mutex_unlock(&cache->mutex);
+        pthread_mutex_unlock(&current_nfuspire_ctx->files_mutex);
+        return 0;
+    }
+
+    pthread_mutex_unlock(&current_nfuspire_ctx->files_mutex);
+
+    rc = nfuspire_attr(current_nfuspire_ctx, path, &item);
     if (rc) {
-        rc = nfuspire_error(rc);
-        goto exit;
+        return rc;
     }
 
     stbuf->st_size = item.size;
@@ -89,135 +442,348 @@ int nfuspire_getattr(const char *path, struct stat *stbuf) {
     stbuf->st_uid = getuid();
     stbuf->st_gid = getgid();
 
-    rc = 0;
-
-exit:
-    pthread_mutex_unlock(&current_nfuspire_ctx->mutex);
-    return rc;
+    return 0;
 }
 
 int nfuspire_mkdir(const char *path) {
     int rc;
 
-    pthread_mutex_lock(&current_nfuspire_ctx->mutex);
+    rc = nfuspire_device_lock(current_nfuspire_ctx);
+    if (rc) {
+        return rc;
+    }
 
     rc = nspire_dir_create(current_nfuspire_ctx->handle, path);
 
-    pthread_mutex_unlock(&current_nfuspire_ctx->mutex);
+    nfuspire_device_unlock(current_nfuspire_ctx);
+
+    if (!rc) {
+        cache_invalidate(current_nfuspire_ctx, path);
+    }
+
     return nfuspire_error(rc);
 }
 
 int nfuspire_rmdir(const char *path) {
     int rc;
 
-    pthread_mutex_lock(&current_nfuspire_ctx->mutex);
+    rc = nfuspire_device_lock(current_nfuspire_ctx);
+    if (rc) {
+        return rc;
+    }
 
     rc = nspire_dir_delete(current_nfuspire_ctx->handle, path);
 
-    pthread_mutex_unlock(&current_nfuspire_ctx->mutex);
+    nfuspire_device_unlock(current_nfuspire_ctx);
+
+    if (!rc) {
+        cache_invalidate(current_nfuspire_ctx, path);
+        devinfo_invalidate(current_nfuspire_ctx);
+    }
+
     return nfuspire_error(rc);
 }
 
+// ctx->files_mutex and cache->mutex must be held
+static int file_cache_retarget_locked(nfuspire_file_cache_t *cache, const char *path) {
+    char *new_path;
+
+    new_path = strdup(path);
+    if (!new_path) {
+        return -ENOMEM;
+    }
+
+    free(cache->path);
+    cache->path = new_path;
+    journal_rename(cache);
+
+    return 0;
+}
+
+// ctx->files_mutex must be held
+static int file_cache_retarget(nfuspire_file_cache_t *cache, const char *path) {
+    int rc;
+
+    pthread_mutex_lock(&cache->mutex);
+    rc = file_cache_retarget_locked(cache, path);
+    pthread_mutex_unlock(&cache->mutex);
+
+    return rc;
+}
+
 int nfuspire_rename(const char *src, const char *dst) {
     int rc;
+    nfuspire_ctx_t *ctx = current_nfuspire_ctx;
+    nfuspire_file_cache_t *cache, *dst_cache;
+    size_t src_len = strlen(src);
+    char path[PATH_MAX];
+    struct nspire_dir_item dst_item;
+    bool dst_on_device = false;
+
+    // A local file replacing one on the device takes its place there, which has to be known before files_mutex
+    pthread_mutex_lock(&ctx->files_mutex);
+    cache = file_cache_find(ctx, src);
+    pthread_mutex_unlock(&ctx->files_mutex);
 
-    pthread_mutex_lock(&current_nfuspire_ctx->mutex);
+    if (cache) {
+        rc = nfuspire_attr(ctx, dst, &dst_item);
+        if (rc && rc != -ENOENT) {
+            return rc;
+        }
 
-    rc = nspire_file_rename(current_nfuspire_ctx->handle, src, dst);
+        dst_on_device = !rc;
+    }
 
-    pthread_mutex_unlock(&current_nfuspire_ctx->mutex);
-    return nfuspire_error(rc);
+    /*
+     * A file that only exists locally is simply uploaded under its new
+     * name, this turns the usual write temp file + rename over the
+     * original into a single write of the destination.
+     */
+    pthread_mutex_lock(&ctx->files_mutex);
+
+    cache = file_cache_find(ctx, src);
+    if (cache) {
+        dst_cache = file_cache_find(ctx, dst);
+
+        // Uploads start and finish under the buffer lock, so on_device can't change until the retarget is done
+        pthread_mutex_lock(&cache->mutex);
+
+        if (!cache->on_device && !cache->uploading) {
+            rc = file_cache_retarget_locked(cache, dst);
+
+            /*
+             * The upload overwrites the device file, until then an unlink
+             * or rename has to deal with it on the device like for any
+             * file it has.
+             */
+            if (!rc && dst_on_device) {
+                cache->on_device = true;
+                cache->device_size = dst_item.size;
+            }
+
+            pthread_mutex_unlock(&cache->mutex);
+
+            if (rc) {
+                goto exit_files;
+            }
+
+            // The same goes for an open destination the device has or is about to get
+            if (dst_cache && dst_cache != cache && file_cache_remove(ctx, dst_cache) && !dst_on_device) {
+                pthread_mutex_lock(&cache->mutex);
+                cache->on_device = true;
+                pthread_mutex_unlock(&cache->mutex);
+            }
+
+            goto exit_files;
+        }
+
+        // Uploaded in the meantime or being uploaded, the device has to rename it once it has it
+        pthread_mutex_unlock(&cache->mutex);
+    }
+
+    pthread_mutex_unlock(&ctx->files_mutex);
+
+    rc = nfuspire_device_lock(ctx);
+    if (rc) {
+        return rc;
+    }
+
+    rc = nspire_file_rename(ctx->handle, src, dst);
+
+    nfuspire_device_unlock(ctx);
+
+    if (rc) {
+        return nfuspire_error(rc);
+    }
+
+    cache_invalidate(ctx, src);
+    cache_invalidate(ctx, dst);
+
+    // Open handles follow the file, or everything below it for a directory
+    pthread_mutex_lock(&ctx->files_mutex);
+
+    dst_cache = file_cache_find(ctx, dst);
+    if (dst_cache && dst_cache != cache) {
+        file_cache_remove(ctx, dst_cache);
+    }
+
+    for (cache = ctx->files; cache; cache = cache->next) {
+        if (strcmp(cache->path, src) == 0) {
+            rc = file_cache_retarget(cache, dst);
+        } else if (strncmp(cache->path, src, src_len) == 0 && cache->path[src_len] == '/') {
+            snprintf(path, sizeof(path), "%s%s", dst, cache->path + src_len);
+            rc = file_cache_retarget(cache, path);
+        }
+
+        if (rc) {
+            break;
+        }
+    }
+
+exit_files:
+    pthread_mutex_unlock(&ctx->files_mutex);
+    return rc;
 }
 
 int nfuspire_unlink(const char *path) {
     int rc;
+    nfuspire_file_cache_t *cache;
+    struct nspire_dir_item item;
 
-    pthread_mutex_lock(&current_nfuspire_ctx->mutex);
+    pthread_mutex_lock(&current_nfuspire_ctx->files_mutex);
+
+    // Open handles must not upload the file again once it's gone
+    cache = file_cache_find(current_nfuspire_ctx, path);
+    if (cache) {
+        if (!file_cache_remove(current_nfuspire_ctx, cache)) {
+            pthread_mutex_unlock(&current_nfuspire_ctx->files_mutex);
+            return 0;
+        }
+    }
+
+    pthread_mutex_unlock(&current_nfuspire_ctx->files_mutex);
+
+    // A running upload holds the device until it's done, after that the device knows the file
+    if (cache) {
+        rc = nfuspire_device_lock(current_nfuspire_ctx);
+        if (rc) {
+            return rc;
+        }
+
+        nfuspire_device_unlock(current_nfuspire_ctx);
+    }
+
+    // Only wanted for the free storage, usually answered by the cache right after a lookup
+    rc = nfuspire_attr(current_nfuspire_ctx, path, &item);
+    if (rc) {
+        return rc;
+    }
+
+    rc = nfuspire_device_lock(current_nfuspire_ctx);
+    if (rc) {
+        return rc;
+    }
 
     rc = nspire_file_delete(current_nfuspire_ctx->handle, path);
 
-    pthread_mutex_unlock(&current_nfuspire_ctx->mutex);
+    nfuspire_device_unlock(current_nfuspire_ctx);
+
+    if (!rc) {
+        cache_invalidate(current_nfuspire_ctx, path);
+        devinfo_storage_used(current_nfuspire_ctx, -(int64_t)item.size);
+    }
+
     return nfuspire_error(rc);
 }
 
 int nfuspire_create(const char *path, struct fuse_file_info *fi) {
-    int rc;
-    struct nspire_dir_item item;
+    nfuspire_ctx_t *ctx = current_nfuspire_ctx;
+    nfuspire_file_cache_t *cache;
 
-    pthread_mutex_lock(&current_nfuspire_ctx->mutex);
+    /*
+     * The kernel only sends create after the lookup failed, the file is
+     * kept local until its first sync so the device only sees the final
+     * content.
+     */
+    pthread_mutex_lock(&ctx->files_mutex);
 
-    rc = nspire_attr(current_nfuspire_ctx->handle, path, &item);
-    if (rc) {
-        if (rc == -NSPIRE_ERR_NONEXIST) {
-            rc = nspire_file_write(current_nfuspire_ctx->handle, path, nullptr, 0);
-            if (rc) {
-                rc = nfuspire_error(rc);
-                goto exit;
-            }
-        } else {
-            rc = nfuspire_error(rc);
-            goto exit;
-        }
+    cache = file_cache_find(ctx, path);
+    if (cache) {
+        cache->refs++;
+        goto exit;
+    }
+
+    cache = calloc(1, sizeof(nfuspire_file_cache_t));
+    if (!cache) {
+        pthread_mutex_unlock(&ctx->files_mutex);
+        return -ENOMEM;
     }
 
-    pthread_mutex_unlock(&current_nfuspire_ctx->mutex);
-    return nfuspire_open(path, fi);
+    cache->path = strdup(path);
+    if (!cache->path) {
+        free(cache);
+        pthread_mutex_unlock(&ctx->files_mutex);
+        return -ENOMEM;
+    }
+
+    pthread_mutex_init(&cache->mutex, NULL);
+    cache->refs = 1;
+    cache->mtime = time(NULL);
+    cache->need_sync = true;
+    cache->on_device = false;
+
+    cache->next = ctx->files;
+    ctx->files = cache;
+
 exit:
-    pthread_mutex_unlock(&current_nfuspire_ctx->mutex);
-    return rc;
+    pthread_mutex_unlock(&ctx->files_mutex);
+    fi->fh = (typeof(fi->fh))cache;
+    return 0;
 }
 
 int nfuspire_open(const char *path, struct fuse_file_info *fi) {
     int rc;
-    nfuspire_file_cache_t *cache;
+    nfuspire_ctx_t *ctx = current_nfuspire_ctx;
+    nfuspire_file_cache_t *cache, *open_cache;
     struct nspire_dir_item item;
 
-    pthread_mutex_lock(&current_nfuspire_ctx->mutex);
+    cache = file_cache_get(ctx, path);
+    if (cache) {
+        fi->fh = (typeof(fi->fh))cache;
+        return 0;
+    }
 
-    rc = nspire_attr(current_nfuspire_ctx->handle, path, &item);
+    rc = nfuspire_attr(ctx, path, &item);
     if (rc) {
-        rc = nfuspire_error(rc);
-        goto exit;
+        return rc;
     }
 
     cache = calloc(1, sizeof(nfuspire_file_cache_t));
     if (!cache) {
-        rc = -ENOMEM;
-        goto exit;
+        return -ENOMEM;
     }
 
-    cache->data = malloc(item.size);
-    if (!cache->data) {
+    cache->path = strdup(path);
+    if (!cache->path) {
         rc = -ENOMEM;
         goto exit_free;
     }
 
+    rc = nfuspire_file_fetch(ctx, path, &item, &cache->data, &cache->size);
+    if (rc) {
+        goto exit_free;
+    }
+
     pthread_mutex_init(&cache->mutex, NULL);
-    cache->size = item.size;
+    cache->refs = 1;
+    cache->device_size = item.size;
+    cache->mtime = item.date;
     cache->need_sync = false;
+    cache->on_device = true;
 
-    if (cache->size) {
-        rc = nspire_file_read(current_nfuspire_ctx->handle, path, cache->data, cache->size, &cache->size);
-        if (rc) {
-            rc = nfuspire_error(rc);
-            goto exit_free;
-        }
+    // Someone else may have opened the same file while we were downloading it
+    pthread_mutex_lock(&ctx->files_mutex);
+
+    open_cache = file_cache_find(ctx, path);
+    if (open_cache) {
+        open_cache->refs++;
+    } else {
+        cache->next = ctx->files;
+        ctx->files = cache;
     }
 
-    fi->fh = (typeof(fi->fh))cache;
-    rc = 0;
-    goto exit;
+    pthread_mutex_unlock(&ctx->files_mutex);
 
-exit_free:
-    if (cache->data) {
-        free(cache->data);
+    if (open_cache) {
+        file_cache_free(cache);
+        cache = open_cache;
     }
 
-    if (cache) {
-        free(cache);
-    }
-exit:
-    pthread_mutex_unlock(&current_nfuspire_ctx->mutex);
+    fi->fh = (typeof(fi->fh))cache;
+    return 0;
+
+exit_free:
+    file_cache_free(cache);
     return rc;
 }
 
@@ -230,9 +796,13 @@ int nfuspire_read(char *buf, size_t size, off_t offset, struct fuse_file_info *f
 
     pthread_mutex_lock(&cache->mutex);
 
-    memset(buf, 0, size);
+    // Another handle may have truncated the shared buffer below offset
+    if ((size_t)offset >= cache->size) {
+        pthread_mutex_unlock(&cache->mutex);
+        return 0;
+    }
 
-    if (offset + size > cache->size) {
+    if (size > cache->size - offset) {
         size = cache->size - offset;
     }
 
@@ -251,8 +821,19 @@ int nfuspire_write(const char *buf, size_t size, off_t offset, struct fuse_file_
         return -EINVAL;
     }
 
+    rc = journal_ready(current_nfuspire_ctx);
+    if (rc) {
+        return rc;
+    }
+
     pthread_mutex_lock(&cache->mutex);
 
+    // Journaled first, a write that can't be made durable fails as a whole
+    rc = journal_write(current_nfuspire_ctx, cache, buf, size, offset);
+    if (rc) {
+        goto exit;
+    }
+
     if (offset + size > cache->size) {
         new_cache_data = realloc(cache->data, offset + size);
         if (!new_cache_data) {
@@ -260,12 +841,19 @@ int nfuspire_write(const char *buf, size_t size, off_t offset, struct fuse_file_
             goto exit;
         }
 
+        // Writing past the end leaves a hole, which has to read back as zeros
+        if ((size_t)offset > cache->size) {
+            memset(new_cache_data + cache->size, 0, offset - cache->size);
+        }
+
         cache->data = new_cache_data;
         cache->size = offset + size;
     }
 
     memcpy(cache->data + offset, buf, size);
+    cache->mtime = time(NULL);
     cache->need_sync = true;
+    cache->version++;
     rc = size;
 
 exit:
@@ -273,62 +861,252 @@ exit:
     return rc;
 }
 
-int nfuspire_fsync(const char *path, struct fuse_file_info *fi) {
-    int rc;
-    nfuspire_file_cache_t *cache = (nfuspire_file_cache_t *)(fi->fh);
+ssize_t nfuspire_copy_file_range(
+    struct fuse_file_info *fi_in, off_t offset_in, struct fuse_file_info *fi_out, off_t offset_out, size_t size
+) {
+    ssize_t rc;
+    nfuspire_file_cache_t *in = (nfuspire_file_cache_t *)(fi_in->fh);
+    nfuspire_file_cache_t *out = (nfuspire_file_cache_t *)(fi_out->fh);
+    unsigned char *new_cache_data;
 
-    if (!cache) {
+    if (!in || !out) {
         return -EINVAL;
     }
 
-    if (!cache->need_sync) {
+    rc = journal_ready(current_nfuspire_ctx);
+    if (rc) {
+        return rc;
+    }
+
+    // Both buffers are locked in a fixed order, so two copies in opposite directions can't deadlock
+    pthread_mutex_lock(in < out ? &in->mutex : &out->mutex);
+    if (in != out) {
+        pthread_mutex_lock(in < out ? &out->mutex : &in->mutex);
+    }
+
+    if ((size_t)offset_in >= in->size) {
+        rc = 0;
+        goto exit;
+    }
+
+    if (size > in->size - offset_in) {
+        size = in->size - offset_in;
+    }
+
+    rc = journal_write(current_nfuspire_ctx, out, in->data + offset_in, size, offset_out);
+    if (rc) {
+        goto exit;
+    }
+
+    if (offset_out + size > out->size) {
+        new_cache_data = realloc(out->data, offset_out + size);
+        if (!new_cache_data) {
+            rc = -ENOMEM;
+            goto exit;
+        }
+
+        // Copying past the end leaves a hole, which has to read back as zeros
+        if ((size_t)offset_out > out->size) {
+            memset(new_cache_data + out->size, 0, offset_out - out->size);
+        }
+
+        out->data = new_cache_data;
+        out->size = offset_out + size;
+    }
+
+    // The source came out of the same buffer when copying within a file
+    memmove(out->data + offset_out, in->data + offset_in, size);
+    out->mtime = time(NULL);
+    out->need_sync = true;
+    out->version++;
+    rc = size;
+
+exit:
+    if (in != out) {
+        pthread_mutex_unlock(in < out ? &out->mutex : &in->mutex);
+    }
+
+    pthread_mutex_unlock(in < out ? &in->mutex : &out->mutex);
+    return rc;
+}
+
+int nfuspire_file_sync(nfuspire_ctx_t *ctx, nfuspire_file_cache_t *cache) {
+    int rc;
+    unsigned char *data = nullptr;
+    char *path = nullptr;
+    size_t size;
+    uint64_t version;
+
+    if (!cache->need_sync || cache->unlinked) {
         return 0;
     }
 
+    /*
+     * The device is taken first and the buffer only held to copy it, so
+     * nothing waiting for the buffer, possibly under files_mutex, waits
+     * for the transfer. A rename or unlink finding the file uploading
+     * leaves it to the device, which it only gets after the upload.
+     */
+    rc = nfuspire_device_lock(ctx);
+    if (rc) {
+        return rc;
+    }
+
     pthread_mutex_lock(&cache->mutex);
-    pthread_mutex_lock(&current_nfuspire_ctx->mutex);
 
-    rc = nspire_file_write(current_nfuspire_ctx->handle, path, cache->data, cache->size);
-    if (!rc) {
-        cache->need_sync = false;
+    // Unlinked or uploaded by someone else while waiting for the device
+    if (!cache->need_sync || cache->unlinked) {
+        pthread_mutex_unlock(&cache->mutex);
+        goto exit_device;
+    }
+
+    size = cache->size;
+    version = cache->version;
+
+    path = strdup(cache->path);
+    data = malloc(size);
+    if (!path || (size && !data)) {
+        pthread_mutex_unlock(&cache->mutex);
+        rc = -ENOMEM;
+        goto exit_free;
     }
 
-    rc = nfuspire_error(rc);
+    if (size) {
+        memcpy(data, cache->data, size);
+    }
+
+    cache->uploading = true;
+
+    pthread_mutex_unlock(&cache->mutex);
+
+    rc = nfuspire_error(nspire_file_write(ctx->handle, path, data, size));
+
+    pthread_mutex_lock(&cache->mutex);
+
+    cache->uploading = false;
+
+    if (!rc) {
+        devinfo_storage_used(ctx, (int64_t)size - (int64_t)cache->device_size);
+        cache->device_size = size;
+        cache->on_device = true;
+
+        // Written to during the upload, the journal still has data the device doesn't
+        if (cache->version == version) {
+            cache->need_sync = false;
+            journal_discard(cache);
+        }
+    }
 
     pthread_mutex_unlock(&cache->mutex);
-    pthread_mutex_unlock(&current_nfuspire_ctx->mutex);
+
+    if (!rc) {
+        cache_invalidate(ctx, path);
+    }
+
+exit_free:
+    free(data);
+    free(path);
+exit_device:
+    nfuspire_device_unlock(ctx);
     return rc;
 }
 
-int nfuspire_release(const char *path, struct fuse_file_info *fi) {
-    int rc;
+int nfuspire_fsync(struct fuse_file_info *fi) {
     nfuspire_file_cache_t *cache = (nfuspire_file_cache_t *)(fi->fh);
 
     if (!cache) {
         return -EINVAL;
     }
 
-    rc = nfuspire_fsync(path, fi);
+    return nfuspire_file_sync(current_nfuspire_ctx, cache);
+}
 
-    if (cache->data) {
-        free(cache->data);
+int nfuspire_release(struct fuse_file_info *fi) {
+    int rc;
+    nfuspire_file_cache_t *cache = (nfuspire_file_cache_t *)(fi->fh);
+
+    if (!cache) {
+        return -EINVAL;
     }
 
-    free(cache);
     fi->fh = 0;
 
+    // The writeback thread takes over our reference
+    if (writeback_defer(current_nfuspire_ctx, cache)) {
+        return 0;
+    }
+
+    rc = nfuspire_file_sync(current_nfuspire_ctx, cache);
+
+    nfuspire_file_put(current_nfuspire_ctx, cache);
+
+    return rc;
+}
+
+static int file_cache_truncate(nfuspire_ctx_t *ctx, nfuspire_file_cache_t *cache, off_t size) {
+    int rc;
+    unsigned char *new_cache_data;
+
+    rc = journal_ready(ctx);
+    if (rc) {
+        return rc;
+    }
+
+    pthread_mutex_lock(&cache->mutex);
+
+    rc = journal_truncate(ctx, cache, size);
+    if (rc) {
+        goto exit;
+    }
+
+    if ((size_t)size > cache->size) {
+        new_cache_data = realloc(cache->data, size);
+        if (!new_cache_data) {
+            rc = -ENOMEM;
+            goto exit;
+        }
+
+        memset(new_cache_data + cache->size, 0, size - cache->size);
+        cache->data = new_cache_data;
+    }
+
+    cache->size = size;
+    cache->mtime = time(NULL);
+    cache->need_sync = true;
+    cache->version++;
+    rc = 0;
+
+exit:
+    pthread_mutex_unlock(&cache->mutex);
     return rc;
 }
 
 int nfuspire_truncate(const char *path, off_t size) {
     int rc;
     void *data = nullptr;
+    nfuspire_file_cache_t *cache;
     struct nspire_dir_item item;
 
-    pthread_mutex_lock(&current_nfuspire_ctx->mutex);
+    // Open files get truncated locally and uploaded on their next sync
+    cache = file_cache_get(current_nfuspire_ctx, path);
+    if (cache) {
+        rc = file_cache_truncate(current_nfuspire_ctx, cache, size);
+        nfuspire_file_put(current_nfuspire_ctx, cache);
+        return rc;
+    }
+
+    rc = nfuspire_device_lock(current_nfuspire_ctx);
+    if (rc) {
+        return rc;
+    }
 
     if (!size) {
         rc = nspire_file_write(current_nfuspire_ctx->handle, path, nullptr, 0);
+        if (!rc) {
+            cache_invalidate(current_nfuspire_ctx, path);
+            devinfo_invalidate(current_nfuspire_ctx);
+        }
+
         rc = nfuspire_error(rc);
         goto exit;
     }
@@ -359,6 +1137,8 @@ int nfuspire_truncate(const char *path, off_t size) {
         goto exit;
     }
 
+    cache_invalidate(current_nfuspire_ctx, path);
+    devinfo_storage_used(current_nfuspire_ctx, (int64_t)size - (int64_t)item.size);
     rc = 0;
 
 exit:
@@ -366,6 +1146,6 @@ exit:
         free(data);
     }
 
-    pthread_mutex_unlock(&current_nfuspire_ctx->mutex);
+    nfuspire_device_unlock(current_nfuspire_ctx);
     return rc;
 }
@@ -0,0 +1,249 @@
+// SPDX-License-Identifier: GPL-3.0-only
+/*
+ *  nfuspire/src/prefetch.c
+ *
+ *  Copyright (C) Emily <info@emy.sh>
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <nfuspire/cache.h>
+#include <nfuspire/flight.h>
+#include <nfuspire/nspire.h>
+#include <nfuspire/prefetch.h>
+#include <nspire.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// ctx->prefetch_mutex must be held
+static unsigned long prefetch_clear(nfuspire_ctx_t *ctx) {
+    prefetch_item_t *item;
+    unsigned long count = 0;
+
+    while ((item = ctx->prefetch_queue)) {
+        ctx->prefetch_queue = item->next;
+        free(item->path);
+        free(item);
+        count++;
+    }
+
+    return count;
+}
+
+static void prefetch_file(nfuspire_ctx_t *ctx, const prefetch_item_t *item) {
+    flight_t *flight;
+    unsigned char *data;
+    size_t size = 0;
+    int rc;
+
+    if (cache_has_data(ctx, item->path, &item->item)) {
+        return;
+    }
+
+    // Like the device info refresh, never make anyone wait for the device
+    if (ctx->conn_state != NFUSPIRE_CONNECTED || pthread_mutex_trylock(&ctx->mutex) != 0) {
+        return;
+    }
+
+    // Anyone asking for the file meanwhile waits for this transfer instead of repeating it
+    flight = flight_begin(
+        ctx, FLIGHT_READ, item->path, item->item.size, item->item.date, cache_generation(ctx), true
+    );
+    if (!flight) {
+        pthread_mutex_unlock(&ctx->mutex);
+        return;
+    }
+
+    data = malloc(item->item.size);
+    if (!data) {
+        pthread_mutex_unlock(&ctx->mutex);
+        flight_land(ctx, flight, -ENOMEM, nullptr, 0);
+        return;
+    }
+
+    rc = nfuspire_error(nspire_file_read(ctx->handle, item->path, data, item->item.size, &size));
+
+    pthread_mutex_unlock(&ctx->mutex);
+
+    if (!rc && size == item->item.size) {
+        cache_put_data(ctx, item->path, &item->item, data, true);
+        stats_prefetched(&ctx->stats, size);
+    }
+
+    flight_land(ctx, flight, rc, data, size);
+    free(data);
+}
+
+static void *prefetch_worker(void *arg) {
+    nfuspire_ctx_t *ctx = arg;
+    prefetch_item_t *item;
+    struct timespec deadline;
+    uint64_t requests = 0;
+    int rc;
+
+    pthread_mutex_lock(&ctx->prefetch_mutex);
+
+    while (ctx->prefetch_running) {
+        if (!ctx->prefetch_queue) {
+            pthread_cond_wait(&ctx->prefetch_cond, &ctx->prefetch_mutex);
+            continue;
+        }
+
+        /*
+         * Prefetching only starts once the device has been left alone
+         * for a moment, and the rest of a directory is given up as soon
+         * as anyone else turns up.
+         */
+        if (ctx->prefetch_waiting) {
+            requests = ctx->device_requests;
+
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += PREFETCH_IDLE_MS * 1000000;
+            if (deadline.tv_nsec >= 1000000000) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000;
+            }
+
+            rc = pthread_cond_timedwait(&ctx->prefetch_cond, &ctx->prefetch_mutex, &deadline);
+            if (rc == ETIMEDOUT && requests == ctx->device_requests) {
+                ctx->prefetch_waiting = false;
+            }
+
+            continue;
+        }
+
+        if (requests != ctx->device_requests) {
+            stats_prefetch_cancelled(&ctx->stats, prefetch_clear(ctx));
+            continue;
+        }
+
+        item = ctx->prefetch_queue;
+        ctx->prefetch_queue = item->next;
+
+        pthread_mutex_unlock(&ctx->prefetch_mutex);
+
+        prefetch_file(ctx, item);
+
+        free(item->path);
+        free(item);
+
+        pthread_mutex_lock(&ctx->prefetch_mutex);
+    }
+
+    prefetch_clear(ctx);
+    pthread_mutex_unlock(&ctx->prefetch_mutex);
+    return nullptr;
+}
+
+int prefetch_start(nfuspire_ctx_t *ctx) {
+    int rc;
+
+    if (!ctx->prefetch_size) {
+        return 0;
+    }
+
+    ctx->prefetch_running = true;
+
+    rc = pthread_create(&ctx->prefetch_thread, NULL, prefetch_worker, ctx);
+    if (rc) {
+        ctx->prefetch_running = false;
+        return -rc;
+    }
+
+    return 0;
+}
+
+void prefetch_stop(nfuspire_ctx_t *ctx) {
+    pthread_mutex_lock(&ctx->prefetch_mutex);
+
+    if (!ctx->prefetch_running) {
+        pthread_mutex_unlock(&ctx->prefetch_mutex);
+        return;
+    }
+
+    ctx->prefetch_running = false;
+    pthread_cond_broadcast(&ctx->prefetch_cond);
+    pthread_mutex_unlock(&ctx->prefetch_mutex);
+
+    pthread_join(ctx->prefetch_thread, NULL);
+}
+
+int prefetch_set_size(nfuspire_ctx_t *ctx, unsigned long size) {
+    int rc = 0;
+
+    pthread_mutex_lock(&ctx->prefetch_mutex);
+
+    ctx->prefetch_size = size;
+
+    if (!size) {
+        stats_prefetch_cancelled(&ctx->stats, prefetch_clear(ctx));
+    }
+
+    // Started under the lock, two settings at once can't both start a thread
+    if (!ctx->prefetch_running) {
+        rc = prefetch_start(ctx);
+    }
+
+    pthread_mutex_unlock(&ctx->prefetch_mutex);
+    return rc;
+}
+
+// Replaces whatever is left of the previous directory, the latest listing is the likeliest to be opened
+void prefetch_dir(nfuspire_ctx_t *ctx, const char *path, const struct nspire_dir_info *list) {
+    prefetch_item_t *item, **tail;
+    unsigned int count = 0;
+    char child[PATH_MAX];
+
+    pthread_mutex_lock(&ctx->prefetch_mutex);
+
+    if (!ctx->prefetch_running || !ctx->prefetch_size) {
+        goto exit;
+    }
+
+    stats_prefetch_cancelled(&ctx->stats, prefetch_clear(ctx));
+    tail = &ctx->prefetch_queue;
+
+    for (uint64_t i = 0; i < list->num && count < PREFETCH_MAX_FILES; i++) {
+        const struct nspire_dir_item *dir_item = &list->items[i];
+
+        // Files the content cache would turn down aren't worth the bus time either
+        if (dir_item->type != NSPIRE_FILE || !dir_item->size || dir_item->size > ctx->prefetch_size ||
+            dir_item->size > ctx->cache_maxsize) {
+            continue;
+        }
+
+        nfuspire_path_join(child, sizeof(child), path, dir_item->name);
+
+        item = calloc(1, sizeof(prefetch_item_t));
+        if (!item) {
+            break;
+        }
+
+        item->path = strdup(child);
+        if (!item->path) {
+            free(item);
+            break;
+        }
+
+        item->item = *dir_item;
+        *tail = item;
+        tail = &item->next;
+        count++;
+    }
+
+    ctx->prefetch_waiting = true;
+    pthread_cond_signal(&ctx->prefetch_cond);
+
+exit:
+    pthread_mutex_unlock(&ctx->prefetch_mutex);
+}
+
+// Called for every request going to the device, prefetching backs off from them
+void prefetch_note_request(nfuspire_ctx_t *ctx) {
+    pthread_mutex_lock(&ctx->prefetch_mutex);
+    ctx->device_requests++;
+    pthread_mutex_unlock(&ctx->prefetch_mutex);
+}
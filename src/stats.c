@@ -0,0 +1,98 @@
+// SPDX-License-Identifier: GPL-3.0-only
+/*
+ *  nfuspire/src/stats.c
+ *
+ *  Copyright (C) Emily <info@emy.sh>
+ */
+
+#include <inttypes.h>
+#include <nfuspire/stats.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+uint64_t stats_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void stats_init(nfuspire_stats_t *stats) {
+    memset(stats, 0, sizeof(*stats));
+    pthread_mutex_init(&stats->mutex, NULL);
+}
+
+void stats_cancelled(nfuspire_stats_t *stats, uint64_t waited) {
+    pthread_mutex_lock(&stats->mutex);
+
+    stats->cancelled++;
+    stats->cancelled_wait_total += waited;
+    if (waited > stats->cancelled_wait_max) {
+        stats->cancelled_wait_max = waited;
+    }
+
+    pthread_mutex_unlock(&stats->mutex);
+}
+
+void stats_shared(nfuspire_stats_t *stats) {
+    pthread_mutex_lock(&stats->mutex);
+    stats->shared++;
+    pthread_mutex_unlock(&stats->mutex);
+}
+
+void stats_prefetched(nfuspire_stats_t *stats, uint64_t bytes) {
+    pthread_mutex_lock(&stats->mutex);
+    stats->prefetched++;
+    stats->prefetched_bytes += bytes;
+    pthread_mutex_unlock(&stats->mutex);
+}
+
+void stats_prefetch_hit(nfuspire_stats_t *stats) {
+    pthread_mutex_lock(&stats->mutex);
+    stats->prefetch_hits++;
+    pthread_mutex_unlock(&stats->mutex);
+}
+
+void stats_prefetch_cancelled(nfuspire_stats_t *stats, uint64_t count) {
+    pthread_mutex_lock(&stats->mutex);
+    stats->prefetch_cancelled += count;
+    pthread_mutex_unlock(&stats->mutex);
+}
+
+int stats_read(nfuspire_stats_t *stats, char *buf, size_t size, off_t offset) {
+    char data[STATS_DATA_SIZE];
+    size_t len;
+
+    pthread_mutex_lock(&stats->mutex);
+
+    snprintf(
+        data, sizeof(data),
+        "cancelled %" PRIu64 "\n"
+        "cancelled_wait_avg_ms %" PRIu64 "\n"
+        "cancelled_wait_max_ms %" PRIu64 "\n"
+        "requests_shared %" PRIu64 "\n"
+        "prefetched %" PRIu64 "\n"
+        "prefetched_bytes %" PRIu64 "\n"
+        "prefetch_hits %" PRIu64 "\n"
+        "prefetch_hit_rate_pct %" PRIu64 "\n"
+        "prefetch_cancelled %" PRIu64 "\n",
+        stats->cancelled, stats->cancelled ? stats->cancelled_wait_total / stats->cancelled : 0,
+        stats->cancelled_wait_max, stats->shared, stats->prefetched, stats->prefetched_bytes, stats->prefetch_hits,
+        stats->prefetched ? stats->prefetch_hits * 100 / stats->prefetched : 0, stats->prefetch_cancelled
+    );
+
+    pthread_mutex_unlock(&stats->mutex);
+
+    len = strlen(data);
+
+    if (offset < 0 || (size_t)offset >= len)
+        return 0;
+
+    if (offset + size > len)
+        size = len - offset;
+
+    memcpy(buf, data + offset, size);
+    return size;
+}
@@ -0,0 +1,177 @@
+// SPDX-License-Identifier: GPL-3.0-only
+/*
+ *  nfuspire/src/tar.c
+ *
+ *  Copyright (C) Emily <info@emy.sh>
+ */
+
+#include <nfuspire/tar.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+static_assert(sizeof(tar_header_t) == TAR_BLOCK_SIZE, "tar header must be exactly one block");
+
+static void tar_checksum(tar_header_t *header) {
+    unsigned int sum = 0;
+
+    memset(header->chksum, ' ', sizeof(header->chksum));
+
+    for (size_t i = 0; i < sizeof(*header); i++) {
+        sum += ((unsigned char *)header)[i];
+    }
+
+    snprintf(header->chksum, sizeof(header->chksum) - 1, "%06o", sum);
+}
+
+static void
+tar_fill(tar_header_t *header, const char *name, char type, uint64_t size, time_t mtime, bool gnu) {
+    memset(header, 0, sizeof(*header));
+
+    strncpy(header->name, name, sizeof(header->name));
+    snprintf(header->mode, sizeof(header->mode), "%07o", type == TAR_TYPE_DIR ? 0755 : 0644);
+    snprintf(header->uid, sizeof(header->uid), "%07o", 0);
+    snprintf(header->gid, sizeof(header->gid), "%07o", 0);
+    snprintf(header->size, sizeof(header->size), "%011llo", (unsigned long long)size);
+    snprintf(header->mtime, sizeof(header->mtime), "%011llo", (unsigned long long)mtime);
+    header->typeflag = type;
+
+    if (gnu) {
+        memcpy(header->magic, "ustar ", sizeof(header->magic));
+        memcpy(header->version, " ", sizeof(header->version));
+    } else {
+        memcpy(header->magic, "ustar", sizeof(header->magic));
+        memcpy(header->version, "00", sizeof(header->version));
+    }
+}
+
+/*
+ * Writes the header blocks for one entry and returns their size. Names
+ * that don't fit ustar's prefix/name split get a GNU long name entry.
+ */
+size_t tar_header(unsigned char *buf, const char *name, char type, uint64_t size, time_t mtime) {
+    tar_header_t *header = (tar_header_t *)buf;
+    size_t len = strlen(name);
+    size_t name_len, offset;
+    const char *split;
+
+    if (len <= sizeof(header->name)) {
+        tar_fill(header, name, type, size, mtime, false);
+        tar_checksum(header);
+        return TAR_BLOCK_SIZE;
+    }
+
+    // Split at a slash so that the last part fits name and the rest fits prefix
+    split = strchr(name + len - sizeof(header->name) - 1, '/');
+    if (split && (size_t)(split - name) <= sizeof(header->prefix) && split[1]) {
+        tar_fill(header, split + 1, type, size, mtime, false);
+        memcpy(header->prefix, name, split - name);
+        tar_checksum(header);
+        return TAR_BLOCK_SIZE;
+    }
+
+    name_len = len < PATH_MAX ? len : PATH_MAX - 1;
+
+    tar_fill(header, "././@LongLink", TAR_TYPE_LONGNAME, name_len + 1, 0, true);
+    tar_checksum(header);
+
+    memset(buf + TAR_BLOCK_SIZE, 0, name_len + 1 + TAR_PADDING(name_len + 1));
+    memcpy(buf + TAR_BLOCK_SIZE, name, name_len);
+    offset = TAR_BLOCK_SIZE + name_len + 1 + TAR_PADDING(name_len + 1);
+
+    header = (tar_header_t *)(buf + offset);
+    tar_fill(header, name, type, size, mtime, true);
+    tar_checksum(header);
+
+    return offset + TAR_BLOCK_SIZE;
+}
+
+bool tar_header_zero(const tar_header_t *header) {
+    for (size_t i = 0; i < sizeof(*header); i++) {
+        if (((const unsigned char *)header)[i]) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool tar_header_valid(const tar_header_t *header) {
+    unsigned int sum = 0;
+
+    for (size_t i = 0; i < sizeof(*header); i++) {
+        if (i >= offsetof(tar_header_t, chksum) && i < offsetof(tar_header_t, chksum) + sizeof(header->chksum)) {
+            sum += ' ';
+        } else {
+            sum += ((const unsigned char *)header)[i];
+        }
+    }
+
+    return tar_number(header->chksum, sizeof(header->chksum)) == sum;
+}
+
+// Octal, or base-256 with the high bit set as GNU tar writes large values
+uint64_t tar_number(const char *field, size_t len) {
+    uint64_t value = 0;
+    size_t i = 0;
+
+    if ((unsigned char)field[0] & 0x80) {
+        value = (unsigned char)field[0] & 0x7f;
+        for (i = 1; i < len; i++) {
+            value = (value << 8) | (unsigned char)field[i];
+        }
+
+        return value;
+    }
+
+    while (i < len && field[i] == ' ') {
+        i++;
+    }
+
+    for (; i < len && field[i] >= '0' && field[i] <= '7'; i++) {
+        value = value * 8 + (field[i] - '0');
+    }
+
+    return value;
+}
+
+void tar_name(const tar_header_t *header, char *name, size_t size) {
+    // Only POSIX ustar has a prefix, GNU uses that space for other fields
+    if (memcmp(header->magic, "ustar", sizeof(header->magic)) == 0 && header->prefix[0]) {
+        snprintf(
+            name, size, "%.*s/%.*s", (int)sizeof(header->prefix), header->prefix, (int)sizeof(header->name),
+            header->name
+        );
+    } else {
+        snprintf(name, size, "%.*s", (int)sizeof(header->name), header->name);
+    }
+}
+
+// Extended headers are "<length> <key>=<value>\n" records
+bool tar_pax_path(const char *data, size_t len, char *name, size_t size) {
+    const char *record = data, *key, *end;
+    uint64_t record_len;
+
+    while (record < data + len) {
+        record_len = 0;
+        for (key = record; key < data + len && *key >= '0' && *key <= '9'; key++) {
+            record_len = record_len * 10 + (*key - '0');
+        }
+
+        if (!record_len || record_len > (uint64_t)(data + len - record) || key >= data + len || *key != ' ') {
+            return false;
+        }
+
+        key++;
+        end = record + record_len - 1;
+
+        if (end - key > 5 && memcmp(key, "path=", 5) == 0) {
+            snprintf(name, size, "%.*s", (int)(end - key - 5), key + 5);
+            return true;
+        }
+
+        record += record_len;
+    }
+
+    return false;
+}
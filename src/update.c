@@ -6,6 +6,7 @@
  */
 
 #include <errno.h>
+#include <nfuspire/connect.h>
 #include <nfuspire/nspire.h>
 #include <nspire.h>
 #include <stdio.h>
@@ -71,7 +72,12 @@ int update_fsync(struct fuse_file_info *fi) {
     }
 
     pthread_mutex_lock(&cache->mutex);
-    pthread_mutex_lock(&current_nfuspire_ctx->mutex);
+
+    rc = nfuspire_device_lock(current_nfuspire_ctx);
+    if (rc) {
+        pthread_mutex_unlock(&cache->mutex);
+        return rc;
+    }
 
     rc = nspire_os_send(current_nfuspire_ctx->handle, cache->data, cache->size);
 
@@ -80,7 +86,7 @@ int update_fsync(struct fuse_file_info *fi) {
     rc = nfuspire_error(rc);
 
     pthread_mutex_unlock(&cache->mutex);
-    pthread_mutex_unlock(&current_nfuspire_ctx->mutex);
+    nfuspire_device_unlock(current_nfuspire_ctx);
     return rc;
 }
 
@@ -0,0 +1,247 @@
+// SPDX-License-Identifier: GPL-3.0-only
+/*
+ *  nfuspire/src/writeback.c
+ *
+ *  Copyright (C) Emily <info@emy.sh>
+ */
+
+#include <errno.h>
+#include <nfuspire/nspire.h>
+#include <nfuspire/writeback.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// ctx->files_mutex must be held
+static nfuspire_file_cache_t *writeback_next(nfuspire_ctx_t *ctx, uint64_t now, uint64_t *next) {
+    *next = 0;
+
+    for (nfuspire_file_cache_t *cache = ctx->files; cache; cache = cache->next) {
+        if (!cache->pending) {
+            continue;
+        }
+
+        if (cache->pending_until <= now) {
+            return cache;
+        }
+
+        if (!*next || cache->pending_until < *next) {
+            *next = cache->pending_until;
+        }
+    }
+
+    return nullptr;
+}
+
+static void *writeback_worker(void *arg) {
+    nfuspire_ctx_t *ctx = arg;
+    nfuspire_file_cache_t *cache;
+    struct timespec deadline;
+    uint64_t now, next;
+    int rc;
+
+    pthread_mutex_lock(&ctx->files_mutex);
+
+    for (;;) {
+        // Once stopping, everything still pending is due
+        now = ctx->writeback_running ? stats_now() : UINT64_MAX;
+
+        cache = writeback_next(ctx, now, &next);
+        if (cache) {
+            cache->pending = false;
+            pthread_mutex_unlock(&ctx->files_mutex);
+
+            rc = nfuspire_file_sync(ctx, cache);
+
+            pthread_mutex_lock(&ctx->files_mutex);
+
+            cache->upload_error = rc;
+
+            /*
+             * A failed upload keeps its data and its reference and is tried
+             * again later, unless a newer close queued it meanwhile or it
+             * was removed. Once stopping there is no later, a journaled
+             * file is replayed on the next mount.
+             */
+            if (rc && ctx->writeback_running && !cache->pending && !cache->unlinked) {
+                cache->pending = true;
+                cache->pending_until = stats_now() + WRITEBACK_RETRY_DELAY;
+                fprintf(stderr, "Unable to upload %s, retrying: %s\n", cache->path, strerror(-rc));
+                continue;
+            }
+
+            if (rc) {
+                fprintf(stderr, "Unable to upload %s: %s\n", cache->path, strerror(-rc));
+            }
+
+            pthread_mutex_unlock(&ctx->files_mutex);
+            nfuspire_file_put(ctx, cache);
+            pthread_mutex_lock(&ctx->files_mutex);
+            continue;
+        }
+
+        if (!ctx->writeback_running) {
+            break;
+        }
+
+        if (next) {
+            deadline.tv_sec = next / 1000;
+            deadline.tv_nsec = (next % 1000) * 1000000;
+            pthread_cond_timedwait(&ctx->writeback_cond, &ctx->files_mutex, &deadline);
+        } else {
+            pthread_cond_wait(&ctx->writeback_cond, &ctx->files_mutex);
+        }
+    }
+
+    pthread_mutex_unlock(&ctx->files_mutex);
+    return nullptr;
+}
+
+int writeback_start(nfuspire_ctx_t *ctx) {
+    int rc;
+
+    if (!ctx->upload_delay) {
+        return 0;
+    }
+
+    ctx->writeback_running = true;
+
+    rc = pthread_create(&ctx->writeback_thread, NULL, writeback_worker, ctx);
+    if (rc) {
+        ctx->writeback_running = false;
+        return -rc;
+    }
+
+    return 0;
+}
+
+void writeback_stop(nfuspire_ctx_t *ctx) {
+    pthread_mutex_lock(&ctx->files_mutex);
+
+    if (!ctx->writeback_running) {
+        pthread_mutex_unlock(&ctx->files_mutex);
+        return;
+    }
+
+    ctx->writeback_running = false;
+    pthread_cond_broadcast(&ctx->writeback_cond);
+    pthread_mutex_unlock(&ctx->files_mutex);
+
+    pthread_join(ctx->writeback_thread, NULL);
+}
+
+bool writeback_defer(nfuspire_ctx_t *ctx, nfuspire_file_cache_t *cache) {
+    pthread_mutex_lock(&ctx->files_mutex);
+
+    /*
+     * Files that were never uploaded are held back, giving a following
+     * rename the chance to retarget them before the device sees
+     * anything. Journaled files survive a crash, so they can wait too.
+     * A delay of 0 set at runtime means uploading on close again.
+     */
+    if (!ctx->writeback_running || !ctx->upload_delay || (cache->on_device && !cache->journal) ||
+        !cache->need_sync || cache->unlinked) {
+        pthread_mutex_unlock(&ctx->files_mutex);
+        return false;
+    }
+
+    // A pending file already holds a reference of its own
+    if (cache->pending) {
+        cache->refs--;
+    }
+
+    cache->pending = true;
+    cache->pending_until = stats_now() + ctx->upload_delay;
+
+    pthread_cond_signal(&ctx->writeback_cond);
+    pthread_mutex_unlock(&ctx->files_mutex);
+    return true;
+}
+
+int writeback_set_delay(nfuspire_ctx_t *ctx, unsigned int delay) {
+    int rc = 0;
+
+    pthread_mutex_lock(&ctx->files_mutex);
+
+    ctx->upload_delay = delay;
+    pthread_cond_signal(&ctx->writeback_cond);
+
+    // Started under the lock, two settings at once can't both start a thread
+    if (!ctx->writeback_running) {
+        rc = writeback_start(ctx);
+    }
+
+    pthread_mutex_unlock(&ctx->files_mutex);
+    return rc;
+}
+
+unsigned int writeback_failed(nfuspire_ctx_t *ctx, int *error) {
+    unsigned int count = 0;
+
+    *error = 0;
+
+    pthread_mutex_lock(&ctx->files_mutex);
+
+    for (nfuspire_file_cache_t *cache = ctx->files; cache; cache = cache->next) {
+        if (cache->pending && cache->upload_error) {
+            count++;
+            *error = cache->upload_error;
+        }
+    }
+
+    pthread_mutex_unlock(&ctx->files_mutex);
+    return count;
+}
+
+int writeback_flush(nfuspire_ctx_t *ctx) {
+    int rc = 0, sync_rc;
+    size_t count = 0, i = 0;
+    nfuspire_file_cache_t **caches;
+
+    pthread_mutex_lock(&ctx->files_mutex);
+
+    for (nfuspire_file_cache_t *cache = ctx->files; cache; cache = cache->next) {
+        count++;
+    }
+
+    caches = malloc(count * sizeof(nfuspire_file_cache_t *));
+    if (!caches) {
+        pthread_mutex_unlock(&ctx->files_mutex);
+        return -ENOMEM;
+    }
+
+    for (nfuspire_file_cache_t *cache = ctx->files; cache; cache = cache->next) {
+        cache->refs++;
+        caches[i++] = cache;
+    }
+
+    pthread_mutex_unlock(&ctx->files_mutex);
+
+    for (i = 0; i < count; i++) {
+        // Once interrupted only the references are dropped
+        if (rc != -EINTR) {
+            sync_rc = nfuspire_file_sync(ctx, caches[i]);
+            if (sync_rc && (!rc || sync_rc == -EINTR)) {
+                rc = sync_rc;
+            }
+        }
+
+        // Uploaded ahead of time, the writeback thread has nothing left to do with it
+        pthread_mutex_lock(&ctx->files_mutex);
+
+        if (caches[i]->pending && !caches[i]->need_sync) {
+            caches[i]->pending = false;
+            caches[i]->refs--;
+        }
+
+        pthread_mutex_unlock(&ctx->files_mutex);
+
+        nfuspire_file_put(ctx, caches[i]);
+    }
+
+    free(caches);
+    return rc;
+}